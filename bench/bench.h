@@ -0,0 +1,72 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Include first, before any system header
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Shared helpers for the benchmarks. Every result is one JSON object per
+ * line on stdout so runs can be collected and compared by scripts.
+ */
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static inline void bench_report_throughput(
+  const char *name,
+  uint64_t ops,
+  uint64_t elapsed_ns
+) {
+  printf(
+    "{\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.1f}\n",
+    name, (unsigned long long) ops,
+    ops > 0 ? (double) elapsed_ns / ops : 0.0
+  );
+  fflush(stdout);
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+  uint64_t va = *(const uint64_t *) a;
+  uint64_t vb = *(const uint64_t *) b;
+
+  return (va > vb) - (va < vb);
+}
+
+/**
+ * Report latency percentiles, sorts the samples in place
+ */
+static inline void bench_report_latency(
+  const char *name,
+  const char *params,
+  uint64_t *samples_ns,
+  size_t count
+) {
+  if (count == 0) {
+    return;
+  }
+
+  qsort(samples_ns, count, sizeof(samples_ns[0]), bench_compare_u64);
+
+  printf(
+    "{\"bench\":\"%s\",%s\"samples\":%zu,"
+    "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+    name, params, count,
+    (unsigned long long) samples_ns[count * 50 / 100],
+    (unsigned long long) samples_ns[count * 90 / 100],
+    (unsigned long long) samples_ns[count * 99 / 100],
+    (unsigned long long) samples_ns[count - 1]
+  );
+  fflush(stdout);
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,129 @@
+#include "bench.h"
+
+#include <string.h>
+
+#include "protocol.h"
+
+#define ITERATIONS 1000000
+
+static const char *commands[] = {
+  "SETUP 3 GPIO 17",
+  "ENABLE 3",
+  "set 3 pulse 1500",
+  "SET 3 RANGE 1000 2000",
+  "GET 3 PULSE",
+  "GET 3 STATE",
+  "DISABLE 3",
+  "BOGUS 1 2 3"
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/**
+ * Throughput of the text parser on a mix of commands, and of the pulse
+ * setpoint command alone since that is what streaming clients send
+ */
+static void bench_parse(void) {
+  Command cmd;
+  uint64_t sink = 0;
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += parse_command(commands[i % NUM_COMMANDS], &cmd);
+    sink += cmd.type;
+  }
+  bench_report_throughput("parse_command_mix", ITERATIONS, bench_now_ns() - start);
+
+  start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += parse_command("SET 3 PULSE 1500", &cmd);
+    sink += cmd.data.pulse.value;
+  }
+  bench_report_throughput("parse_command_set_pulse", ITERATIONS, bench_now_ns() - start);
+
+  // Keep the loops from being optimized away
+  if (sink == 42) {
+    printf("\n");
+  }
+}
+
+static void bench_format(void) {
+  Response responses[4];
+  char buffer[MAX_RESPONSE_LENGTH];
+  uint64_t sink = 0;
+
+  memset(responses, 0, sizeof(responses));
+  responses[0].type = RESP_OK;
+  responses[1].type = RESP_PULSE;
+  responses[1].data.pulse.value = 1500;
+  responses[2].type = RESP_RANGE;
+  responses[2].data.range.min = 1000;
+  responses[2].data.range.max = 2000;
+  responses[3].type = RESP_ERROR;
+  strcpy(responses[3].data.error.message, "Pulse value out of range");
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += format_response(&responses[i % 4], buffer, sizeof(buffer));
+  }
+  bench_report_throughput("format_response_mix", ITERATIONS, bench_now_ns() - start);
+
+  if (sink == 42) {
+    printf("\n");
+  }
+}
+
+/**
+ * The same setpoint stream in binary mode: one pulse message, and one
+ * message updating every channel
+ */
+static void bench_binary(void) {
+  uint8_t set_pulse[BINARY_MESSAGE_SIZE] = {BIN_SET_PULSE, 3, 0xdc, 0x05};
+  uint8_t set_all[BINARY_SET_ALL_SIZE];
+  uint8_t buffer[BINARY_MESSAGE_SIZE];
+  Command cmd;
+  Response resp;
+  uint64_t sink = 0;
+
+  memset(set_all, 0, sizeof(set_all));
+  set_all[0] = BIN_SET_ALL_PULSE;
+  for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    set_all[BINARY_MESSAGE_SIZE + 2 * i] = 0xdc;
+    set_all[BINARY_MESSAGE_SIZE + 2 * i + 1] = 0x05;
+  }
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += parse_binary_command(set_pulse, &cmd);
+    sink += cmd.data.pulse.value;
+  }
+  bench_report_throughput("parse_binary_set_pulse", ITERATIONS, bench_now_ns() - start);
+
+  start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += parse_binary_command(set_all, &cmd);
+    sink += cmd.data.all.pulses[i % MAX_SERVO_CHANNELS];
+  }
+  bench_report_throughput("parse_binary_set_all_pulse", ITERATIONS, bench_now_ns() - start);
+
+  cmd.type = CMD_SET_PULSE;
+  resp.type = RESP_OK;
+
+  start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += format_binary_response(&cmd, &resp, buffer, sizeof(buffer));
+  }
+  bench_report_throughput("format_binary_response_ok", ITERATIONS, bench_now_ns() - start);
+
+  if (sink == 42) {
+    printf("\n");
+  }
+}
+
+int main(void) {
+  bench_parse();
+  bench_format();
+  bench_binary();
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include "bench.h"
+
+#include <string.h>
+
+#include "gpio.h"
+#include "pwm.h"
+#include "servo.h"
+#include "timebase.h"
+
+#define FRAMES 200000
+
+static ServoController controller;
+
+static void setup_channels(uint8_t count) {
+  memset(&controller, 0, sizeof(controller));
+  controller.num_channels = MAX_SERVO_CHANNELS;
+
+  for (uint8_t i = 0; i < count; i++) {
+    ServoChannel *ch = &controller.channels[i];
+
+    ch->gpio = 2 + i % (MAX_GPIO_PIN - 1);
+    ch->enabled = 1;
+    ch->min_us = SERVO_MIN_US;
+    ch->max_us = SERVO_MAX_US;
+    // A handful of distinct widths, like a real rig with some servos parked
+    ch->pulse_us = SERVO_MIN_US + (i % 5) * 250;
+  }
+}
+
+/**
+ * CPU cost of one frame on the virtual clock, so sleeps take no time and
+ * only the scheduling work is measured
+ *
+ * @param churn Publish a changed table every frame to include the rebuild
+ */
+static void bench_frames(uint8_t channels, bool churn) {
+  char name[64];
+
+  setup_channels(channels);
+  pwm_init(&controller);
+  pwm_arm();
+
+  // First frame compiles the table
+  pwm_run_frame();
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < FRAMES; i++) {
+    if (churn) {
+      controller.channels[0].pulse_us = SERVO_MIN_US + i % 1000;
+      controller.channels[0].pulse_gen++;
+      pwm_publish(&controller);
+    }
+
+    pwm_run_frame();
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  snprintf(
+    name, sizeof(name), "pwm_run_frame_%s_%uch",
+    churn ? "rebuild" : "steady", channels
+  );
+  bench_report_throughput(name, FRAMES, elapsed);
+
+  pwm_cleanup();
+}
+
+int main(void) {
+  timebase_set_virtual();
+
+  if (!gpio_select_backend("sim") || !gpio_init()) {
+    fprintf(stderr, "Failed to initialize simulated GPIO\n");
+    return 1;
+  }
+
+  const uint8_t counts[] = {1, 8, 16, MAX_SERVO_CHANNELS};
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    bench_frames(counts[i], false);
+    bench_frames(counts[i], true);
+  }
+
+  gpio_cleanup();
+  return 0;
+}
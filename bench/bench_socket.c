@@ -0,0 +1,191 @@
+#include "bench.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define ROUND_TRIPS 2000
+#define CONNECT_RETRIES 200
+
+static char socket_path[64];
+
+typedef struct {
+  int       index;
+  uint64_t *samples;
+  bool      ok;
+} ClientArgs;
+
+static pthread_barrier_t start_barrier;
+
+static int connect_daemon(void) {
+  struct sockaddr_un addr;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Send one command and wait for the complete response line
+ */
+static bool round_trip(int fd, const char *command) {
+  char buffer[256];
+  size_t len = strlen(command);
+
+  if (write(fd, command, len) != (ssize_t) len) {
+    return false;
+  }
+
+  for (;;) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      return false;
+    }
+
+    if (buffer[n - 1] == '\n') {
+      return true;
+    }
+  }
+}
+
+static void *client_thread(void *arg) {
+  ClientArgs *args = arg;
+  char command[64];
+  int channel = args->index % 64;
+
+  int fd = connect_daemon();
+  if (fd < 0) {
+    pthread_barrier_wait(&start_barrier);
+    return NULL;
+  }
+
+  snprintf(command, sizeof(command), "SETUP %d GPIO %d\n", channel, 2 + channel % 26);
+  args->ok = round_trip(fd, command);
+
+  pthread_barrier_wait(&start_barrier);
+
+  for (int i = 0; args->ok && i < ROUND_TRIPS; i++) {
+    snprintf(command, sizeof(command), "SET %d PULSE %d\n", channel, 1000 + i % 1000);
+
+    uint64_t start = bench_now_ns();
+    args->ok = round_trip(fd, command);
+    args->samples[i] = bench_now_ns() - start;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static bool bench_clients(int clients) {
+  pthread_t threads[clients];
+  ClientArgs args[clients];
+  uint64_t *samples = calloc((size_t) clients * ROUND_TRIPS, sizeof(uint64_t));
+
+  if (!samples) {
+    return false;
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, clients);
+
+  for (int i = 0; i < clients; i++) {
+    args[i].index = i;
+    args[i].samples = samples + (size_t) i * ROUND_TRIPS;
+    args[i].ok = false;
+    pthread_create(&threads[i], NULL, client_thread, &args[i]);
+  }
+
+  bool ok = true;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(threads[i], NULL);
+    ok = ok && args[i].ok;
+  }
+
+  pthread_barrier_destroy(&start_barrier);
+
+  if (ok) {
+    char params[64];
+    snprintf(params, sizeof(params), "\"clients\":%d,", clients);
+    bench_report_latency("socket_round_trip", params, samples, (size_t) clients * ROUND_TRIPS);
+  } else {
+    fprintf(stderr, "Round trips with %d clients failed\n", clients);
+  }
+
+  free(samples);
+  return ok;
+}
+
+/**
+ * Start the daemon on the simulated GPIO backend with a private socket
+ */
+static pid_t spawn_daemon(const char *binary) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+  }
+
+  execl(binary, binary, "--gpio", "sim", "--socket", socket_path, (char *) NULL);
+  _exit(127);
+}
+
+int main(int argc, char **argv) {
+  const char *binary = argc > 1 ? argv[1] : "./piservod";
+  const int client_counts[] = {1, 2, 4, 8};
+
+  snprintf(socket_path, sizeof(socket_path), "/tmp/piservod-bench-%d.sock", getpid());
+
+  pid_t daemon = spawn_daemon(binary);
+  if (daemon < 0) {
+    perror("fork");
+    return 1;
+  }
+
+  // Wait for the socket to come up
+  int fd = -1;
+  for (int i = 0; i < CONNECT_RETRIES && fd < 0; i++) {
+    usleep(10000);
+    fd = connect_daemon();
+  }
+
+  if (fd < 0) {
+    fprintf(stderr, "Daemon %s did not come up on %s\n", binary, socket_path);
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    return 1;
+  }
+  close(fd);
+
+  int result = 0;
+  for (size_t i = 0; i < sizeof(client_counts) / sizeof(client_counts[0]); i++) {
+    if (!bench_clients(client_counts[i])) {
+      result = 1;
+    }
+  }
+
+  kill(daemon, SIGTERM);
+  waitpid(daemon, NULL, 0);
+
+  return result;
+}
@@ -1,82 +1,111 @@
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <stddef.h>
 
 #include "gpio.h"
 #include "servo.h"
 
-static volatile uint32_t *gpio_map = NULL;
-static int gpio_fd = -1;
+#define GPIO_SPEC_LENGTH 64
 
-bool gpio_init(void) {
-  if (gpio_map != NULL) {
-    return true;
-  }
+static const GpioBackend *backends[] = {
+  &gpio_backend_mem,
+  &gpio_backend_cdev,
+  &gpio_backend_sim
+};
 
-  gpio_fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
-  if (gpio_fd < 0) {
-    perror("Failed to open /dev/gpiomem");
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+// NULL until gpio_init() succeeded, "auto" until a backend was selected
+static const GpioBackend *backend = NULL;
+static const GpioBackend *selected = NULL;
+static char selected_arg[GPIO_SPEC_LENGTH];
+
+bool gpio_select_backend(const char *spec) {
+  if (!spec) {
     return false;
   }
 
-  // Note: /dev/gpiomem already points to GPIO base, so no offset needed
-  gpio_map = (volatile uint32_t *) mmap(
-    NULL,
-    BLOCK_SIZE,
-    PROT_READ | PROT_WRITE,
-    MAP_SHARED,
-    gpio_fd,
-    0  // /dev/gpiomem is pre-offset to GPIO registers
-  );
+  // Split "name:arg"
+  const char *colon = strchr(spec, ':');
+  size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
 
-  if (gpio_map == MAP_FAILED) {
-    perror("mmap failed");
-    close(gpio_fd);
+  selected_arg[0] = '\0';
+  if (colon) {
+    strncpy(selected_arg, colon + 1, sizeof(selected_arg) - 1);
+    selected_arg[sizeof(selected_arg) - 1] = '\0';
+  }
 
-    gpio_fd = -1;
-    gpio_map = NULL;
+  if (name_len == 4 && strncmp(spec, "auto", 4) == 0) {
+    selected = NULL;
+    return true;
+  }
 
-    return false;
+  for (size_t i = 0; i < NUM_BACKENDS; i++) {
+    if (
+      strlen(backends[i]->name) == name_len &&
+      strncmp(spec, backends[i]->name, name_len) == 0
+    ) {
+      selected = backends[i];
+      return true;
+    }
   }
 
-  return true;
+  return false;
 }
 
-void gpio_cleanup(void) {
-  if (gpio_map != NULL) {
-    munmap((void *)gpio_map, BLOCK_SIZE);
-    gpio_map = NULL;
+const char *gpio_backend_name(void) {
+  if (backend) {
+    return backend->name;
   }
 
-  if (gpio_fd >= 0) {
-    close(gpio_fd);
-    gpio_fd = -1;
+  return selected ? selected->name : "auto";
+}
+
+bool gpio_init(void) {
+  if (backend != NULL) {
+    return true;
+  }
+
+  if (selected) {
+    if (!selected->init(selected_arg[0] ? selected_arg : NULL)) {
+      return false;
+    }
+
+    backend = selected;
+    return true;
+  }
+
+  // Auto: prefer the register mapping, fall back to the character device
+  if (gpio_backend_mem.init(NULL)) {
+    backend = &gpio_backend_mem;
+    return true;
+  }
+
+  fprintf(stderr, "Falling back to GPIO character device\n");
+  if (gpio_backend_cdev.init(NULL)) {
+    backend = &gpio_backend_cdev;
+    return true;
+  }
+
+  return false;
+}
+
+void gpio_cleanup(void) {
+  if (backend != NULL) {
+    backend->cleanup();
+    backend = NULL;
   }
 }
 
 static void gpio_set_function(uint8_t pin, uint8_t function) {
   if (
-    gpio_map == NULL ||
+    backend == NULL ||
     pin > MAX_GPIO_PIN
   ) {
     return;
   }
 
-  uint8_t reg_index = pin / 10;          // Which GPFSEL register (0-5)
-  uint8_t bit_offset = (pin % 10) * 3;   // Bit position within register
-
-  volatile uint32_t *reg = &gpio_map[GPFSEL0 + reg_index];
-  uint32_t value = *reg;
-
-  // Clear the 3 bits for this pin
-  value &= ~(0b111 << bit_offset);
-
-  // Set the new function
-  value |= ((function & 0b111) << bit_offset);
-
-  *reg = value;
+  backend->set_function(pin, function);
 }
 
 void gpio_set_output(uint8_t pin) {
@@ -89,42 +118,49 @@ void gpio_set_input(uint8_t pin) {
 
 void gpio_set(uint8_t pin) {
   if (
-    gpio_map == NULL ||
+    backend == NULL ||
     pin > MAX_GPIO_PIN
   ) {
     return;
   }
 
-  uint8_t reg_index = (pin < 32) ? GPSET0 : GPSET1;
-  uint8_t bit = pin % 32;
-
-  gpio_map[reg_index] = (1 << bit);
+  backend->set_mask(GPIO_BIT(pin));
 }
 
 void gpio_clear(uint8_t pin) {
   if (
-    gpio_map == NULL ||
+    backend == NULL ||
     pin > MAX_GPIO_PIN
   ) {
     return;
   }
 
-  uint8_t reg_index = (pin < 32) ? GPCLR0 : GPCLR1;
-  uint8_t bit = pin % 32;
+  backend->clear_mask(GPIO_BIT(pin));
+}
+
+void gpio_set_mask(uint32_t mask) {
+  if (backend == NULL) {
+    return;
+  }
 
-  gpio_map[reg_index] = (1 << bit);
+  backend->set_mask(mask);
+}
+
+void gpio_clear_mask(uint32_t mask) {
+  if (backend == NULL) {
+    return;
+  }
+
+  backend->clear_mask(mask);
 }
 
 uint8_t gpio_read(uint8_t pin) {
   if (
-    gpio_map == NULL ||
+    backend == NULL ||
     pin > MAX_GPIO_PIN
   ) {
     return 0;
   }
 
-  uint8_t reg_index = (pin < 32) ? GPLEV0 : GPLEV1;
-  uint8_t bit = pin % 32;
-
-  return (gpio_map[reg_index] & (1 << bit)) ? 1 : 0;
-}
\ No newline at end of file
+  return (backend->read_mask() & GPIO_BIT(pin)) ? 1 : 0;
+}
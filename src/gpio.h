@@ -4,23 +4,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/* BCM2835 GPIO register offsets (in 32-bit words) */
-#define GPFSEL0   0   // Function select 0
-#define GPFSEL1   1
-#define GPFSEL2   2
-#define GPFSEL3   3
-#define GPFSEL4   4
-#define GPFSEL5   5
-
-#define GPSET0    7   // Set bits (output high)
-#define GPSET1    8
-
-#define GPCLR0    10  // Clear bits (output low)
-#define GPCLR1    11
-
-#define GPLEV0    13  // Pin level (read input)
-#define GPLEV1    14
-
 /* GPIO function select modes */
 #define GPIO_FSEL_INPUT   0b000
 #define GPIO_FSEL_OUTPUT  0b001
@@ -31,7 +14,50 @@
 #define GPIO_FSEL_ALT4    0b011
 #define GPIO_FSEL_ALT5    0b010
 
-#define BLOCK_SIZE (4*1024)
+// Bit for a pin in the bank 0 set/clear masks
+#define GPIO_BIT(pin) (1u << (pin))
+
+/*
+ * Hardware access behind the gpio_* API. Masks always use BCM bank 0
+ * numbering, backends translate them to whatever their hardware needs.
+ */
+typedef struct {
+  const char *name;
+  bool     (*init)(const char *arg);
+  void     (*cleanup)(void);
+  void     (*set_function)(uint8_t pin, uint8_t function);
+  void     (*set_mask)(uint32_t mask);
+  void     (*clear_mask)(uint32_t mask);
+  uint32_t (*read_mask)(void);
+} GpioBackend;
+
+extern const GpioBackend gpio_backend_mem;
+extern const GpioBackend gpio_backend_cdev;
+extern const GpioBackend gpio_backend_sim;
+
+/**
+ * Choose the backend used by gpio_init()
+ *
+ * @param spec "auto", "gpiomem", "cdev[:/dev/gpiochipN]" or "sim[:file.vcd]"
+ *
+ * @return false if the backend is unknown
+ */
+bool gpio_select_backend(const char *spec);
+const char *gpio_backend_name(void);
+
+typedef struct {
+  uint32_t pulses;
+  double   min_us;
+  double   max_us;
+  double   mean_us;
+} GpioSimPulses;
+
+/**
+ * High times recorded by the simulated backend ("sim:<file.vcd>")
+ *
+ * @return false if the pin saw no complete pulse or nothing is recorded
+ */
+bool gpio_sim_pulse_stats(uint8_t pin, GpioSimPulses *out);
 
 bool gpio_init(void);
 void gpio_cleanup(void);
@@ -40,6 +66,9 @@ void gpio_set_output(uint8_t pin);
 void gpio_set_input(uint8_t pin);
 void gpio_set(uint8_t pin);
 void gpio_clear(uint8_t pin);
+// Drive every pin in the bank 0 mask with a single register write
+void gpio_set_mask(uint32_t mask);
+void gpio_clear_mask(uint32_t mask);
 
 uint8_t gpio_read(uint8_t pin);
 
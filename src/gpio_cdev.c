@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "gpio.h"
+#include "servo.h"
+
+#define CDEV_DEFAULT_CHIP "/dev/gpiochip0"
+#define CDEV_CONSUMER "piservod"
+
+/*
+ * Linux GPIO character device (uAPI v2). All lines we drive live in one
+ * line request, so a whole set/clear mask is a single ioctl.
+ *
+ * The kernel only lets one request hold a line, so adding a line means
+ * releasing the running request first, and its lines fall back to the
+ * kernel until the new one is in place. That is only done while every
+ * line we drive is low. Lines are only ever appended, so a line keeps its
+ * index across rebuilds. A writer may still use the previous fd number for
+ * a moment, but only to clear lines that are low already.
+ */
+#define CDEV_REBUILD_WAIT_NS  200000
+#define CDEV_REBUILD_ATTEMPTS 500  // Give up waiting for all low after 100ms
+
+static int chip_fd = -1;
+static atomic_int request_fd = -1;
+
+static uint32_t offsets[GPIO_V2_LINES_MAX];
+static uint8_t num_lines = 0;
+static int8_t line_index[MAX_GPIO_PIN + 1];
+static uint64_t input_lines = 0;  // Request bits of lines set to input
+static atomic_uint_least64_t line_levels;
+
+static bool cdev_init(const char *arg) {
+  const char *path = arg ? arg : CDEV_DEFAULT_CHIP;
+
+  if (chip_fd >= 0) {
+    return true;
+  }
+
+  chip_fd = open(path, O_RDWR | O_CLOEXEC);
+  if (chip_fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  memset(line_index, -1, sizeof(line_index));
+  num_lines = 0;
+  input_lines = 0;
+  atomic_store(&line_levels, 0);
+
+  return true;
+}
+
+static void cdev_cleanup(void) {
+  int fd = atomic_exchange(&request_fd, -1);
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (chip_fd >= 0) {
+    close(chip_fd);
+    chip_fd = -1;
+  }
+
+  num_lines = 0;
+}
+
+static uint64_t cdev_outputs(void) {
+  uint64_t all = num_lines == 64 ? ~0ULL : (1ULL << num_lines) - 1;
+  return all & ~input_lines;
+}
+
+/**
+ * Fill in a line config: outputs by default, inputs and initial output
+ * levels as attributes
+ */
+static void cdev_fill_config(struct gpio_v2_line_config *config) {
+  memset(config, 0, sizeof(*config));
+  config->flags = GPIO_V2_LINE_FLAG_OUTPUT;
+
+  uint32_t attr = 0;
+
+  config->attrs[attr].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  config->attrs[attr].attr.values = atomic_load(&line_levels);
+  config->attrs[attr].mask = cdev_outputs();
+  attr++;
+
+  if (input_lines) {
+    config->attrs[attr].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+    config->attrs[attr].attr.flags = GPIO_V2_LINE_FLAG_INPUT;
+    config->attrs[attr].mask = input_lines;
+    attr++;
+  }
+
+  config->num_attrs = attr;
+}
+
+/**
+ * Write out the levels of writes that found no request installed
+ *
+ * Repeats until the levels did not move during the write, so a writer
+ * that raced with it is not undone.
+ */
+static void cdev_sync_levels(int fd) {
+  uint64_t levels = atomic_load(&line_levels);
+
+  for (;;) {
+    struct gpio_v2_line_values values = {
+      .bits = levels,
+      .mask = cdev_outputs()
+    };
+
+    ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+
+    uint64_t now = atomic_load(&line_levels);
+    if (now == levels) {
+      return;
+    }
+    levels = now;
+  }
+}
+
+/**
+ * Replace the line request with one covering all known lines, once every
+ * line we drive is low
+ *
+ * The running request is taken away from writers before the levels are
+ * checked, so a writer raising a line either shows up in the levels or
+ * finds no request and leaves its write to cdev_sync_levels().
+ */
+static bool cdev_request_lines(void) {
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+
+  memcpy(req.offsets, offsets, num_lines * sizeof(offsets[0]));
+  req.num_lines = num_lines;
+  strncpy(req.consumer, CDEV_CONSUMER, sizeof(req.consumer) - 1);
+
+  for (int attempt = 0; ; attempt++) {
+    int old = atomic_exchange(&request_fd, -1);
+
+    if (old >= 0 && atomic_load(&line_levels) != 0) {
+      if (attempt < CDEV_REBUILD_ATTEMPTS) {
+        atomic_store(&request_fd, old);
+        cdev_sync_levels(old);
+
+        struct timespec wait = { .tv_sec = 0, .tv_nsec = CDEV_REBUILD_WAIT_NS };
+        nanosleep(&wait, NULL);
+        continue;
+      }
+
+      fprintf(stderr, "GPIO outputs never all low, rebuilding the line request anyway\n");
+    }
+
+    if (old >= 0) {
+      close(old);
+    }
+
+    cdev_fill_config(&req.config);
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+      fprintf(stderr, "Failed to request GPIO lines: %s\n", strerror(errno));
+      return false;
+    }
+
+    atomic_store(&request_fd, req.fd);
+    cdev_sync_levels(req.fd);
+    return true;
+  }
+}
+
+static void cdev_set_function(uint8_t pin, uint8_t function) {
+  if (chip_fd < 0) {
+    return;
+  }
+
+  int8_t index = line_index[pin];
+
+  if (index < 0) {
+    // Never requested, inputs can stay with the kernel
+    if (function != GPIO_FSEL_OUTPUT || num_lines >= GPIO_V2_LINES_MAX) {
+      return;
+    }
+
+    index = num_lines;
+    offsets[num_lines++] = pin;
+    input_lines &= ~(1ULL << index);
+
+    if (cdev_request_lines()) {
+      line_index[pin] = index;
+      return;
+    }
+
+    // Get the running lines back without the new one
+    num_lines--;
+    if (num_lines > 0) {
+      cdev_request_lines();
+    }
+
+    return;
+  }
+
+  uint64_t bit = 1ULL << index;
+  if (function == GPIO_FSEL_OUTPUT) {
+    input_lines &= ~bit;
+  } else {
+    input_lines |= bit;
+  }
+
+  // Existing lines are reconfigured in place
+  struct gpio_v2_line_config config;
+  cdev_fill_config(&config);
+
+  int fd = atomic_load(&request_fd);
+  if (fd >= 0 && ioctl(fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+    fprintf(stderr, "Failed to configure GPIO %u: %s\n", pin, strerror(errno));
+  }
+}
+
+/**
+ * Translate a BCM bank mask to request line bits
+ */
+static uint64_t cdev_lines(uint32_t mask) {
+  uint64_t lines = 0;
+
+  for (; mask; mask &= mask - 1) {
+    int pin = __builtin_ctz(mask);
+    if (pin <= MAX_GPIO_PIN && line_index[pin] >= 0) {
+      lines |= 1ULL << line_index[pin];
+    }
+  }
+
+  return lines;
+}
+
+static void cdev_write(uint32_t mask, bool high) {
+  uint64_t lines = cdev_lines(mask);
+  if (!lines) {
+    return;
+  }
+
+  if (high) {
+    atomic_fetch_or(&line_levels, lines);
+  } else {
+    atomic_fetch_and(&line_levels, ~lines);
+  }
+
+  struct gpio_v2_line_values values = {
+    .bits = high ? lines : 0,
+    .mask = lines
+  };
+
+  // Loaded after the levels were updated, see cdev_request_lines()
+  int fd = atomic_load(&request_fd);
+  if (fd >= 0) {
+    ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+  }
+}
+
+static void cdev_set_mask(uint32_t mask) {
+  cdev_write(mask, true);
+}
+
+static void cdev_clear_mask(uint32_t mask) {
+  cdev_write(mask, false);
+}
+
+static uint32_t cdev_read_mask(void) {
+  int fd = atomic_load(&request_fd);
+  if (fd < 0 || num_lines == 0) {
+    return 0;
+  }
+
+  struct gpio_v2_line_values values = {
+    .bits = 0,
+    .mask = num_lines == 64 ? ~0ULL : (1ULL << num_lines) - 1
+  };
+
+  if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+    return 0;
+  }
+
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < num_lines; i++) {
+    if (values.bits & (1ULL << i)) {
+      mask |= GPIO_BIT(offsets[i]);
+    }
+  }
+
+  return mask;
+}
+
+const GpioBackend gpio_backend_cdev = {
+  .name = "cdev",
+  .init = cdev_init,
+  .cleanup = cdev_cleanup,
+  .set_function = cdev_set_function,
+  .set_mask = cdev_set_mask,
+  .clear_mask = cdev_clear_mask,
+  .read_mask = cdev_read_mask
+};
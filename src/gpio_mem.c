@@ -0,0 +1,118 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "gpio.h"
+
+/* BCM2835 GPIO register offsets (in 32-bit words) */
+#define GPFSEL0   0   // Function select 0
+#define GPFSEL1   1
+#define GPFSEL2   2
+#define GPFSEL3   3
+#define GPFSEL4   4
+#define GPFSEL5   5
+
+#define GPSET0    7   // Set bits (output high)
+#define GPSET1    8
+
+#define GPCLR0    10  // Clear bits (output low)
+#define GPCLR1    11
+
+#define GPLEV0    13  // Pin level (read input)
+#define GPLEV1    14
+
+#define BLOCK_SIZE (4*1024)
+
+static volatile uint32_t *gpio_map = NULL;
+static int gpio_fd = -1;
+
+/**
+ * Map the BCM GPIO registers through /dev/gpiomem
+ */
+static bool mem_init(const char *arg) {
+  (void)arg;
+
+  if (gpio_map != NULL) {
+    return true;
+  }
+
+  gpio_fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
+  if (gpio_fd < 0) {
+    perror("Failed to open /dev/gpiomem");
+    return false;
+  }
+
+  // Note: /dev/gpiomem already points to GPIO base, so no offset needed
+  gpio_map = (volatile uint32_t *) mmap(
+    NULL,
+    BLOCK_SIZE,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    gpio_fd,
+    0  // /dev/gpiomem is pre-offset to GPIO registers
+  );
+
+  if (gpio_map == MAP_FAILED) {
+    perror("mmap failed");
+    close(gpio_fd);
+
+    gpio_fd = -1;
+    gpio_map = NULL;
+
+    return false;
+  }
+
+  return true;
+}
+
+static void mem_cleanup(void) {
+  if (gpio_map != NULL) {
+    munmap((void *)gpio_map, BLOCK_SIZE);
+    gpio_map = NULL;
+  }
+
+  if (gpio_fd >= 0) {
+    close(gpio_fd);
+    gpio_fd = -1;
+  }
+}
+
+static void mem_set_function(uint8_t pin, uint8_t function) {
+  uint8_t reg_index = pin / 10;          // Which GPFSEL register (0-5)
+  uint8_t bit_offset = (pin % 10) * 3;   // Bit position within register
+
+  volatile uint32_t *reg = &gpio_map[GPFSEL0 + reg_index];
+  uint32_t value = *reg;
+
+  // Clear the 3 bits for this pin
+  value &= ~(0b111 << bit_offset);
+
+  // Set the new function
+  value |= ((function & 0b111) << bit_offset);
+
+  *reg = value;
+}
+
+static void mem_set_mask(uint32_t mask) {
+  gpio_map[GPSET0] = mask;
+}
+
+static void mem_clear_mask(uint32_t mask) {
+  gpio_map[GPCLR0] = mask;
+}
+
+static uint32_t mem_read_mask(void) {
+  return gpio_map[GPLEV0];
+}
+
+const GpioBackend gpio_backend_mem = {
+  .name = "gpiomem",
+  .init = mem_init,
+  .cleanup = mem_cleanup,
+  .set_function = mem_set_function,
+  .set_mask = mem_set_mask,
+  .clear_mask = mem_clear_mask,
+  .read_mask = mem_read_mask
+};
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpio.h"
+#include "servo.h"
+#include "timebase.h"
+
+// Each record covers every pin switched by one mask write
+#define SIM_RECORD_CAPACITY (1u << 20)
+
+typedef struct {
+  uint64_t time_ns;
+  uint32_t mask;
+  uint32_t high;
+  uint32_t seq;  // Slot claimed, orders writes sharing a timestamp
+} SimRecord;
+
+/*
+ * In-memory GPIO bank for running without hardware. Levels are atomic since
+ * the PWM thread and the socket thread may both drive pins.
+ *
+ * With a VCD path every level transition is timestamped on the timebase and
+ * appended to a preallocated buffer. Writers claim a slot with a single
+ * fetch_add, so recording never blocks; once the buffer is full further
+ * transitions are only counted.
+ * The buffer is read once all writers stopped.
+ */
+static atomic_uint_least32_t levels;
+static uint8_t functions[MAX_GPIO_PIN + 1];
+
+static char *vcd_path = NULL;
+static SimRecord *records = NULL;
+static atomic_uint_least32_t record_head;
+static atomic_uint_least32_t record_drops;
+static bool records_sorted = false;
+
+static void sim_record(uint32_t mask, bool high) {
+  if (!records || !mask) {
+    return;
+  }
+
+  uint32_t index = atomic_fetch_add_explicit(&record_head, 1, memory_order_relaxed);
+  if (index >= SIM_RECORD_CAPACITY) {
+    atomic_fetch_add_explicit(&record_drops, 1, memory_order_relaxed);
+    return;
+  }
+
+  records[index].time_ns = timebase_now_ns();
+  records[index].mask = mask;
+  records[index].high = high;
+  records[index].seq = index;
+}
+
+static uint32_t record_count(void) {
+  uint32_t count = atomic_load(&record_head);
+  return count < SIM_RECORD_CAPACITY ? count : SIM_RECORD_CAPACITY;
+}
+
+static int compare_records(const void *a, const void *b) {
+  const SimRecord *ra = a;
+  const SimRecord *rb = b;
+
+  if (ra->time_ns != rb->time_ns) {
+    return (ra->time_ns > rb->time_ns) - (ra->time_ns < rb->time_ns);
+  }
+
+  // qsort() is not stable, a clear and a set at the same time keep their order
+  return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+/**
+ * Writers may have claimed slots slightly out of order, sort once they
+ * are done
+ */
+static void sort_records(void) {
+  if (!records_sorted) {
+    qsort(records, record_count(), sizeof(SimRecord), compare_records);
+    records_sorted = true;
+  }
+}
+
+static void sim_write_vcd(void) {
+  FILE *file = fopen(vcd_path, "w");
+  if (!file) {
+    perror("Failed to open VCD file");
+    return;
+  }
+
+  sort_records();
+
+  uint32_t count = record_count();
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    used |= records[i].mask;
+  }
+
+  fprintf(file, "$version piservod simulated GPIO $end\n");
+  fprintf(file, "$timescale 1ns $end\n");
+  fprintf(file, "$scope module gpio $end\n");
+
+  // One printable identifier character per pin
+  for (uint8_t pin = 0; pin <= MAX_GPIO_PIN; pin++) {
+    if (used & GPIO_BIT(pin)) {
+      fprintf(file, "$var wire 1 %c gpio%u $end\n", '!' + pin, pin);
+    }
+  }
+
+  fprintf(file, "$upscope $end\n");
+  fprintf(file, "$enddefinitions $end\n");
+
+  uint64_t start = count > 0 ? records[0].time_ns : 0;
+
+  fprintf(file, "#0\n$dumpvars\n");
+  for (uint8_t pin = 0; pin <= MAX_GPIO_PIN; pin++) {
+    if (used & GPIO_BIT(pin)) {
+      fprintf(file, "0%c\n", '!' + pin);
+    }
+  }
+  fprintf(file, "$end\n");
+
+  uint64_t last_time = UINT64_MAX;
+  for (uint32_t i = 0; i < count; i++) {
+    const SimRecord *rec = &records[i];
+
+    if (rec->time_ns != last_time) {
+      fprintf(file, "#%llu\n", (unsigned long long)(rec->time_ns - start));
+      last_time = rec->time_ns;
+    }
+
+    for (uint32_t mask = rec->mask; mask; mask &= mask - 1) {
+      fprintf(file, "%c%c\n", rec->high ? '1' : '0', '!' + __builtin_ctz(mask));
+    }
+  }
+
+  fclose(file);
+
+  printf("Wrote %u transitions to %s", count, vcd_path);
+  uint32_t drops = atomic_load(&record_drops);
+  if (drops > 0) {
+    printf(" (%u dropped, buffer full)", drops);
+  }
+  printf("\n");
+}
+
+static bool sim_init(const char *arg) {
+  atomic_store(&levels, 0);
+  memset(functions, GPIO_FSEL_INPUT, sizeof(functions));
+
+  if (!arg) {
+    return true;
+  }
+
+  records = malloc(SIM_RECORD_CAPACITY * sizeof(SimRecord));
+  vcd_path = strdup(arg);
+  if (!records || !vcd_path) {
+    fprintf(stderr, "Failed to allocate simulated GPIO recorder\n");
+    free(records);
+    free(vcd_path);
+    records = NULL;
+    vcd_path = NULL;
+
+    return false;
+  }
+
+  atomic_store(&record_head, 0);
+  atomic_store(&record_drops, 0);
+  records_sorted = false;
+
+  return true;
+}
+
+static void sim_cleanup(void) {
+  atomic_store(&levels, 0);
+
+  if (records) {
+    sim_write_vcd();
+  }
+
+  free(records);
+  free(vcd_path);
+  records = NULL;
+  vcd_path = NULL;
+}
+
+static void sim_set_function(uint8_t pin, uint8_t function) {
+  functions[pin] = function;
+}
+
+static uint32_t output_mask(void) {
+  uint32_t mask = 0;
+
+  for (uint8_t pin = 0; pin <= MAX_GPIO_PIN; pin++) {
+    if (functions[pin] == GPIO_FSEL_OUTPUT) {
+      mask |= GPIO_BIT(pin);
+    }
+  }
+
+  return mask;
+}
+
+static void sim_set_mask(uint32_t mask) {
+  uint32_t old = atomic_fetch_or_explicit(&levels, mask, memory_order_relaxed);
+  sim_record(mask & ~old, true);
+}
+
+static void sim_clear_mask(uint32_t mask) {
+  uint32_t old = atomic_fetch_and_explicit(&levels, ~mask, memory_order_relaxed);
+  sim_record(mask & old, false);
+}
+
+static uint32_t sim_read_mask(void) {
+  // Like the hardware, only outputs reflect what was written
+  return atomic_load_explicit(&levels, memory_order_relaxed) & output_mask();
+}
+
+/**
+ * Measure the high times recorded on a pin
+ *
+ * Only valid once nothing drives pins anymore.
+ *
+ * @return false if nothing was recorded or no complete pulse was seen
+ */
+bool gpio_sim_pulse_stats(uint8_t pin, GpioSimPulses *out) {
+  if (!records || !out || pin > MAX_GPIO_PIN) {
+    return false;
+  }
+
+  sort_records();
+
+  uint32_t bit = GPIO_BIT(pin);
+  uint32_t count = record_count();
+  uint64_t rise = 0;
+  bool high = false;
+  double sum = 0;
+
+  memset(out, 0, sizeof(*out));
+
+  for (uint32_t i = 0; i < count; i++) {
+    const SimRecord *rec = &records[i];
+    if (!(rec->mask & bit)) {
+      continue;
+    }
+
+    if (rec->high) {
+      rise = rec->time_ns;
+      high = true;
+      continue;
+    }
+
+    if (!high) {
+      continue;
+    }
+
+    double width_us = (rec->time_ns - rise) / 1000.0;
+    if (out->pulses == 0 || width_us < out->min_us) {
+      out->min_us = width_us;
+    }
+    if (width_us > out->max_us) {
+      out->max_us = width_us;
+    }
+
+    sum += width_us;
+    out->pulses++;
+    high = false;
+  }
+
+  if (out->pulses == 0) {
+    return false;
+  }
+
+  out->mean_us = sum / out->pulses;
+  return true;
+}
+
+const GpioBackend gpio_backend_sim = {
+  .name = "sim",
+  .init = sim_init,
+  .cleanup = sim_cleanup,
+  .set_function = sim_set_function,
+  .set_mask = sim_set_mask,
+  .clear_mask = sim_clear_mask,
+  .read_mask = sim_read_mask
+};
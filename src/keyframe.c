@@ -0,0 +1,201 @@
+#include <stdatomic.h>
+
+#include "keyframe.h"
+
+typedef struct {
+  uint32_t at_ms;
+  uint16_t pulse_us;
+} Keyframe;
+
+typedef struct {
+  Keyframe              keys[KEYFRAME_QUEUE_SIZE];
+  atomic_uint_least32_t head;  // Written by the socket thread only
+  atomic_uint_least32_t tail;  // Written by the PWM thread only
+} KeyframeQueue;
+
+static KeyframeQueue queues[MAX_SERVO_CHANNELS];
+
+/*
+ * Playback control from the socket thread. playback is gen << 1 | playing,
+ * play_frame the grid frame its clock starts on. stop_gen counts STOPs,
+ * each of which drops the queues up to drop_until.
+ */
+static atomic_uint playback;
+static atomic_uint_least64_t play_frame;
+static atomic_uint stop_gen;
+static atomic_uint_least32_t drop_until[MAX_SERVO_CHANNELS];
+
+// Socket thread only
+static bool playing;
+static uint64_t min_at_ms[MAX_SERVO_CHANNELS];  // Earliest time the next key may have
+
+KeyframeResult keyframe_push(uint8_t channel, uint32_t at_ms, uint16_t pulse_us) {
+  KeyframeQueue *queue = &queues[channel];
+
+  if (at_ms < min_at_ms[channel]) {
+    return KEYFRAME_OUT_OF_ORDER;
+  }
+
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head - tail == KEYFRAME_QUEUE_SIZE) {
+    return KEYFRAME_FULL;
+  }
+
+  queue->keys[head & (KEYFRAME_QUEUE_SIZE - 1)] = (Keyframe) {at_ms, pulse_us};
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  min_at_ms[channel] = (uint64_t) at_ms + 1;
+
+  return KEYFRAME_OK;
+}
+
+bool keyframe_play(uint64_t start_frame) {
+  if (playing) {
+    return false;
+  }
+
+  playing = true;
+  atomic_store_explicit(&play_frame, start_frame, memory_order_relaxed);
+
+  unsigned gen = atomic_load_explicit(&playback, memory_order_relaxed) >> 1;
+  atomic_store_explicit(&playback, (gen + 1) << 1 | 1, memory_order_release);
+
+  return true;
+}
+
+void keyframe_stop(void) {
+  for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    uint32_t head = atomic_load_explicit(&queues[i].head, memory_order_relaxed);
+    atomic_store_explicit(&drop_until[i], head, memory_order_relaxed);
+    min_at_ms[i] = 0;
+  }
+
+  atomic_fetch_add_explicit(&stop_gen, 1, memory_order_release);
+
+  playing = false;
+
+  unsigned gen = atomic_load_explicit(&playback, memory_order_relaxed) >> 1;
+  atomic_store_explicit(&playback, (gen + 1) << 1, memory_order_release);
+}
+
+/**
+ * Apply PLAY and STOP requests at the frame boundary
+ */
+static void keyframe_apply_control(KeyframePlayer *player, uint64_t channels) {
+  unsigned stops = atomic_load_explicit(&stop_gen, memory_order_acquire);
+  if (stops != player->seen_stop_gen) {
+    player->seen_stop_gen = stops;
+
+    for (uint64_t mask = channels; mask; mask &= mask - 1) {
+      int i = __builtin_ctzll(mask);
+      KeyframeQueue *queue = &queues[i];
+      uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+      uint32_t until = atomic_load_explicit(&drop_until[i], memory_order_relaxed);
+
+      // Only ever move forward, keys may have been consumed meanwhile
+      if ((int32_t) (until - tail) > 0) {
+        atomic_store_explicit(&queue->tail, until, memory_order_release);
+      }
+    }
+
+    for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+      player->origins[i].valid = false;
+    }
+  }
+
+  unsigned state = atomic_load_explicit(&playback, memory_order_acquire);
+  if (state != player->seen_playback) {
+    player->seen_playback = state;
+    player->clock_running = state & 1;
+    player->start_frame = atomic_load_explicit(&play_frame, memory_order_relaxed);
+
+    for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+      player->origins[i].valid = false;
+    }
+  }
+}
+
+static int16_t clamp_pulse(const ServoChannel *ch, int32_t pulse_us) {
+  if (pulse_us < ch->min_us) {
+    return ch->min_us;
+  }
+
+  return pulse_us > ch->max_us ? ch->max_us : pulse_us;
+}
+
+bool keyframe_step(
+  KeyframePlayer *player, ServoChannel *table, uint8_t num_channels,
+  uint64_t channels, uint64_t frame, uint32_t frame_us
+) {
+  keyframe_apply_control(player, channels);
+
+  // Every player derives the clock from the grid, so shards stay in step
+  if (!player->clock_running || frame < player->start_frame) {
+    return false;
+  }
+
+  bool changed = false;
+  uint64_t clock_us = (frame - player->start_frame) * frame_us;
+
+  if (num_channels < MAX_SERVO_CHANNELS) {
+    channels &= (1ULL << num_channels) - 1;
+  }
+
+  for (uint64_t mask = channels; mask; mask &= mask - 1) {
+    int i = __builtin_ctzll(mask);
+    KeyframeQueue *queue = &queues[i];
+    KeyframeOrigin *origin = &player->origins[i];
+    ServoChannel *ch = &table[i];
+
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail == head) {
+      origin->valid = false;
+      continue;
+    }
+
+    // A track that starts now ramps from wherever the channel is
+    if (!origin->valid) {
+      origin->valid = true;
+      origin->at_us = clock_us;
+      origin->pulse_us = ch->pulse_us;
+    }
+
+    // Consume every keyframe that is due, the last one becomes the origin
+    while (tail != head) {
+      const Keyframe *key = &queue->keys[tail & (KEYFRAME_QUEUE_SIZE - 1)];
+      uint64_t at_us = (uint64_t) key->at_ms * 1000;
+
+      if (at_us > clock_us) {
+        break;
+      }
+
+      origin->at_us = at_us;
+      origin->pulse_us = key->pulse_us;
+      tail++;
+    }
+
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+
+    int32_t pulse_us = origin->pulse_us;
+
+    if (tail != head) {
+      const Keyframe *next = &queue->keys[tail & (KEYFRAME_QUEUE_SIZE - 1)];
+      uint64_t next_us = (uint64_t) next->at_ms * 1000;
+      int64_t span = next_us - origin->at_us;
+      int64_t done = clock_us - origin->at_us;
+
+      pulse_us += (int64_t) (next->pulse_us - origin->pulse_us) * done / span;
+    }
+
+    pulse_us = clamp_pulse(ch, pulse_us);
+    if (ch->gpio != 0 && pulse_us != ch->pulse_us) {
+      ch->pulse_us = pulse_us;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
@@ -0,0 +1,70 @@
+#ifndef KEYFRAME_H
+#define KEYFRAME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "servo.h"
+
+// Per channel, must be a power of two
+#define KEYFRAME_QUEUE_SIZE 128
+
+typedef enum {
+  KEYFRAME_OK,
+  KEYFRAME_FULL,
+  KEYFRAME_OUT_OF_ORDER
+} KeyframeResult;
+
+/*
+ * Keyframe playback. Every channel has a single-producer single-consumer
+ * ring: the socket thread appends (time, pulse) pairs, the PWM thread
+ * consumes them. All channels share one playback clock that starts at 0
+ * on the grid frame PLAY names and advances one frame period per frame, so
+ * tracks uploaded ahead of time stay in sync no matter when they arrived
+ * or which PWM shard plays them.
+ */
+
+// Where a channel's current segment starts
+typedef struct {
+  bool     valid;
+  uint64_t at_us;
+  int16_t  pulse_us;
+} KeyframeOrigin;
+
+/*
+ * Playback state of one PWM thread. Every PWM shard consumes the queues of
+ * the channels it drives with a player of its own.
+ */
+typedef struct {
+  unsigned       seen_playback;
+  unsigned       seen_stop_gen;
+  bool           clock_running;
+  uint64_t       start_frame;  // Grid frame the clock is 0 on
+  KeyframeOrigin origins[MAX_SERVO_CHANNELS];
+} KeyframePlayer;
+
+// Socket thread: queue a keyframe, times must increase per channel
+KeyframeResult keyframe_push(uint8_t channel, uint32_t at_ms, uint16_t pulse_us);
+// Socket thread: start the playback clock at 0 on a grid frame
+bool keyframe_play(uint64_t start_frame);
+// Socket thread: stop playback and drop every queued keyframe
+void keyframe_stop(void);
+
+/**
+ * PWM thread, once per frame: interpolate pulses at the playback clock of
+ * a grid frame
+ *
+ * Channels with keyframes queued are driven by them, others keep their
+ * pulse.
+ *
+ * @param channels Mask of the channels this player consumes
+ * @param frame    Grid frame the pulses are for
+ *
+ * @return true if any pulse changed
+ */
+bool keyframe_step(
+  KeyframePlayer *player, ServoChannel *table, uint8_t num_channels,
+  uint64_t channels, uint64_t frame, uint32_t frame_us
+);
+
+#endif /* KEYFRAME_H */
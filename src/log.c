@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "log.h"
+
+// How long the writer sleeps once every ring is empty
+#define LOG_POLL_NS 10000000L
+
+typedef struct {
+  uint64_t time_ns;  // CLOCK_REALTIME
+  uint64_t args[2];
+  LogEvent event;
+} LogRecord;
+
+/*
+ * head and tail each live on their own cache line, so the producer and
+ * the writer thread only share a line when a record changes hands.
+ */
+typedef struct {
+  _Alignas(64) atomic_uint_least32_t head;  // Producer side
+  atomic_uint_least64_t dropped;
+  _Alignas(64) atomic_uint_least32_t tail;  // Writer side
+  LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+typedef enum {
+  TARGET_STDERR,
+  TARGET_SYSLOG,
+  TARGET_FILE
+} LogTarget;
+
+static LogRing rings[LOG_MAX_THREADS];
+static atomic_uint num_rings;
+// Records from threads that found every ring taken
+static atomic_uint_least64_t unclaimed_dropped;
+static _Thread_local LogRing *thread_ring;
+
+static struct {
+  LogTarget target;
+  FILE *file;
+  pthread_t thread;
+  atomic_bool running;
+  bool started;
+  uint64_t reported_dropped;
+} writer;
+
+static uint64_t realtime_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void log_push(LogEvent event, uint64_t arg0, uint64_t arg1) {
+  if (!thread_ring) {
+    unsigned index = atomic_fetch_add_explicit(&num_rings, 1, memory_order_relaxed);
+
+    if (index >= LOG_MAX_THREADS) {
+      atomic_fetch_add_explicit(&unclaimed_dropped, 1, memory_order_relaxed);
+      return;
+    }
+
+    thread_ring = &rings[index];
+  }
+
+  LogRing *ring = thread_ring;
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head - tail >= LOG_RING_SIZE) {
+    uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    atomic_store_explicit(&ring->dropped, dropped + 1, memory_order_relaxed);
+    return;
+  }
+
+  LogRecord *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+  record->time_ns = realtime_ns();
+  record->args[0] = arg0;
+  record->args[1] = arg1;
+  record->event = event;
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+uint64_t log_dropped(void) {
+  uint64_t dropped = atomic_load_explicit(&unclaimed_dropped, memory_order_relaxed);
+  unsigned count = atomic_load_explicit(&num_rings, memory_order_relaxed);
+
+  for (unsigned i = 0; i < count && i < LOG_MAX_THREADS; i++) {
+    dropped += atomic_load_explicit(&rings[i].dropped, memory_order_relaxed);
+  }
+
+  return dropped;
+}
+
+static void write_line(int priority, uint64_t time_ns, const char *message) {
+  switch (writer.target) {
+    case TARGET_STDERR: {
+      fprintf(stderr, "%s\n", message);
+    } break;
+
+    case TARGET_SYSLOG: {
+      syslog(priority, "%s", message);
+    } break;
+
+    case TARGET_FILE: {
+      time_t seconds = time_ns / 1000000000ULL;
+      struct tm tm;
+      char stamp[32];
+
+      localtime_r(&seconds, &tm);
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+      fprintf(
+        writer.file, "%s.%06" PRIu64 " %s\n",
+        stamp, time_ns % 1000000000 / 1000, message
+      );
+    } break;
+  }
+}
+
+static void write_record(const LogRecord *record) {
+  char message[128];
+  int priority = LOG_INFO;
+
+  switch (record->event) {
+    case LOG_TIMER_FAILED: {
+      priority = LOG_ERR;
+      snprintf(
+        message, sizeof(message), "Error: timerfd read failed: %s",
+        strerror((int) record->args[0])
+      );
+    } break;
+
+    case LOG_MISSED_FRAMES: {
+      priority = LOG_WARNING;
+      snprintf(message, sizeof(message), "Warning: Missed %" PRIu64 " PWM frames", record->args[0]);
+    } break;
+
+    case LOG_CLIENT_CONNECTED: {
+      snprintf(
+        message, sizeof(message), "Client connected (id %" PRIu64 ", %" PRIu64 " active)",
+        record->args[0], record->args[1]
+      );
+    } break;
+
+    case LOG_CLIENT_DISCONNECTED: {
+      snprintf(
+        message, sizeof(message), "Client disconnected (id %" PRIu64 ", %" PRIu64 " active)",
+        record->args[0], record->args[1]
+      );
+    } break;
+
+    case LOG_CLIENT_INVALID: {
+      priority = LOG_WARNING;
+      snprintf(message, sizeof(message), "Invalid binary message from client %" PRIu64, record->args[0]);
+    } break;
+
+    default: {
+      snprintf(message, sizeof(message), "Unknown log event %d", (int) record->event);
+    } break;
+  }
+
+  write_line(priority, record->time_ns, message);
+}
+
+/**
+ * Write out everything queued so far
+ *
+ * @return Whether there was anything to write
+ */
+static bool drain(void) {
+  bool written = false;
+  unsigned count = atomic_load_explicit(&num_rings, memory_order_acquire);
+
+  for (unsigned i = 0; i < count && i < LOG_MAX_THREADS; i++) {
+    LogRing *ring = &rings[i];
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head) {
+      LogRecord record = ring->records[tail & (LOG_RING_SIZE - 1)];
+      atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+
+      write_record(&record);
+      written = true;
+    }
+  }
+
+  // Drops are reported once the ring had room again
+  uint64_t dropped = log_dropped();
+  if (dropped != writer.reported_dropped) {
+    char message[64];
+
+    snprintf(
+      message, sizeof(message), "Warning: Dropped %" PRIu64 " log records",
+      dropped - writer.reported_dropped
+    );
+    write_line(LOG_WARNING, realtime_ns(), message);
+
+    writer.reported_dropped = dropped;
+    written = true;
+  }
+
+  if (written && writer.target == TARGET_FILE) {
+    fflush(writer.file);
+  }
+
+  return written;
+}
+
+static void *log_thread(void *arg) {
+  (void) arg;
+
+  while (atomic_load(&writer.running)) {
+    if (!drain()) {
+      struct timespec delay = {.tv_sec = 0, .tv_nsec = LOG_POLL_NS};
+      nanosleep(&delay, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+bool log_open(const char *target) {
+  if (strcmp(target, "stderr") == 0) {
+    writer.target = TARGET_STDERR;
+  } else if (strcmp(target, "syslog") == 0) {
+    writer.target = TARGET_SYSLOG;
+    openlog("piservod", LOG_PID, LOG_DAEMON);
+  } else {
+    writer.target = TARGET_FILE;
+    writer.file = fopen(target, "a");
+
+    if (!writer.file) {
+      fprintf(stderr, "Failed to open log file %s: %s\n", target, strerror(errno));
+      return false;
+    }
+  }
+
+  atomic_store(&writer.running, true);
+
+  // Signals are handled by the main thread only
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  int err = pthread_create(&writer.thread, NULL, log_thread, NULL);
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    fprintf(stderr, "Error: Could not start log thread: %s\n", strerror(err));
+    atomic_store(&writer.running, false);
+
+    if (writer.file) {
+      fclose(writer.file);
+      writer.file = NULL;
+    }
+
+    return false;
+  }
+
+  writer.started = true;
+  return true;
+}
+
+void log_close(void) {
+  if (!writer.started) {
+    return;
+  }
+
+  atomic_store(&writer.running, false);
+  pthread_join(writer.thread, NULL);
+  writer.started = false;
+
+  drain();
+
+  if (writer.target == TARGET_SYSLOG) {
+    closelog();
+  } else if (writer.file) {
+    fclose(writer.file);
+    writer.file = NULL;
+  }
+}
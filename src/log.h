@@ -0,0 +1,45 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Logging that is safe on the real-time path. Every thread pushes fixed
+ * size binary records into its own single-producer ring, which never
+ * blocks and never allocates. A normal priority thread formats the
+ * records and writes them out. A full ring drops the record and counts it.
+ */
+
+#define LOG_RING_SIZE 256    // Records per thread, must be a power of two
+#define LOG_MAX_THREADS 8
+
+typedef enum {
+  LOG_TIMER_FAILED,          // errno
+  LOG_MISSED_FRAMES,         // frames
+  LOG_CLIENT_CONNECTED,      // client id, active clients
+  LOG_CLIENT_DISCONNECTED,   // client id, active clients
+  LOG_CLIENT_INVALID,        // client id
+} LogEvent;
+
+/**
+ * Queue a record from the calling thread
+ *
+ * The first call from a thread claims one of LOG_MAX_THREADS rings.
+ */
+void log_push(LogEvent event, uint64_t arg0, uint64_t arg1);
+
+/**
+ * Start the writer thread
+ *
+ * @param target "stderr", "syslog", or a file name to append to
+ */
+bool log_open(const char *target);
+
+// Write out every queued record and stop the writer thread
+void log_close(void);
+
+// Records dropped on full rings since startup
+uint64_t log_dropped(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,524 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "stats.h"
+
+// Scrapes served at once, the oldest one is dropped for a new one
+#define METRICS_MAX_CONNECTIONS 4
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_RESPONSE_SIZE 32768
+
+typedef struct {
+  bool          in_use;
+  int           fd;
+  unsigned long serial;        // Accept order, the lowest is dropped first
+  char          request[METRICS_REQUEST_SIZE];
+  size_t        request_len;
+  char         *response;      // NULL until the request is complete
+  size_t        response_len;
+  size_t        sent;
+} MetricsConnection;
+
+static struct {
+  atomic_uint_least64_t commands[NUM_COMMAND_TYPES];
+  atomic_uint_least64_t rejected[NUM_COMMAND_TYPES];
+  atomic_uint_least64_t bytes_in;
+  atomic_uint_least64_t bytes_out;
+  atomic_uint_least64_t clients;
+} counters;
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static char *socket_path = NULL;
+static unsigned long next_serial = 0;
+static MetricsConnection connections[METRICS_MAX_CONNECTIONS];
+
+static inline void counter_add(atomic_uint_least64_t *counter, uint64_t value) {
+  atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(atomic_uint_least64_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void metrics_count_command(CommandType type, bool rejected) {
+  if ((unsigned) type >= NUM_COMMAND_TYPES) {
+    type = CMD_INVALID;
+  }
+
+  counter_add(&counters.commands[type], 1);
+  if (rejected) {
+    counter_add(&counters.rejected[type], 1);
+  }
+}
+
+void metrics_add_bytes_in(size_t bytes) {
+  counter_add(&counters.bytes_in, bytes);
+}
+
+void metrics_add_bytes_out(size_t bytes) {
+  counter_add(&counters.bytes_out, bytes);
+}
+
+void metrics_set_clients(size_t clients) {
+  atomic_store_explicit(&counters.clients, clients, memory_order_relaxed);
+}
+
+typedef struct {
+  char   *buffer;
+  size_t  size;
+  size_t  length;
+} Output;
+
+__attribute__((format(printf, 2, 3)))
+static void emit(Output *out, const char *format, ...) {
+  if (out->length + 1 >= out->size) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(out->buffer + out->length, out->size - out->length, format, args);
+  va_end(args);
+
+  if (written > 0) {
+    out->length += (size_t) written;
+    if (out->length >= out->size) {
+      out->length = out->size - 1;
+    }
+  }
+}
+
+static void emit_header(Output *out, const char *name, const char *type, const char *help) {
+  emit(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+size_t metrics_render(char *buffer, size_t buffer_size) {
+  Output out = {buffer, buffer_size, 0};
+  StatsTotals totals;
+
+  if (buffer_size == 0) {
+    return 0;
+  }
+  buffer[0] = '\0';
+
+  stats_totals(&totals);
+
+  emit_header(&out, "piservod_frames_total", "counter", "PWM frames run.");
+  emit(&out, "piservod_frames_total %llu\n", (unsigned long long) totals.frames);
+
+  emit_header(
+    &out, "piservod_missed_frames_total", "counter",
+    "PWM frames skipped because the PWM thread woke up too late."
+  );
+  emit(&out, "piservod_missed_frames_total %llu\n", (unsigned long long) totals.missed);
+
+  emit_header(
+    &out, "piservod_overruns_total", "counter",
+    "Frames that started late or after missed frames, by cause."
+  );
+
+  for (int i = 0; i < STATS_NUM_CAUSES; i++) {
+    emit(
+      &out, "piservod_overruns_total{cause=\"%s\"} %llu\n",
+      stats_cause_name(i), (unsigned long long) totals.overruns[i]
+    );
+  }
+
+  emit_header(
+    &out, "piservod_edge_lateness_seconds", "histogram",
+    "How late output edges were against their deadline."
+  );
+
+  uint64_t cumulative = 0;
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    cumulative += totals.edges[i];
+
+    if (stats_bucket_us(i) == UINT32_MAX) {
+      emit(
+        &out, "piservod_edge_lateness_seconds_bucket{le=\"+Inf\"} %llu\n",
+        (unsigned long long) cumulative
+      );
+    } else {
+      emit(
+        &out, "piservod_edge_lateness_seconds_bucket{le=\"%g\"} %llu\n",
+        stats_bucket_us(i) / 1e6, (unsigned long long) cumulative
+      );
+    }
+  }
+
+  emit(&out, "piservod_edge_lateness_seconds_sum %.6f\n", totals.late_us / 1e6);
+  emit(&out, "piservod_edge_lateness_seconds_count %llu\n", (unsigned long long) cumulative);
+
+  emit_header(
+    &out, "piservod_commands_total", "counter",
+    "Commands received, lines that did not parse count as invalid."
+  );
+  for (int i = 0; i < NUM_COMMAND_TYPES; i++) {
+    emit(
+      &out, "piservod_commands_total{command=\"%s\"} %llu\n",
+      command_name(i), (unsigned long long) counter_get(&counters.commands[i])
+    );
+  }
+
+  emit_header(
+    &out, "piservod_commands_rejected_total", "counter",
+    "Commands answered with an error."
+  );
+  for (int i = 0; i < NUM_COMMAND_TYPES; i++) {
+    emit(
+      &out, "piservod_commands_rejected_total{command=\"%s\"} %llu\n",
+      command_name(i), (unsigned long long) counter_get(&counters.rejected[i])
+    );
+  }
+
+  emit_header(&out, "piservod_clients", "gauge", "Connected control clients.");
+  emit(&out, "piservod_clients %llu\n", (unsigned long long) counter_get(&counters.clients));
+
+  emit_header(
+    &out, "piservod_received_bytes_total", "counter",
+    "Bytes received from control clients."
+  );
+  emit(
+    &out, "piservod_received_bytes_total %llu\n",
+    (unsigned long long) counter_get(&counters.bytes_in)
+  );
+
+  emit_header(
+    &out, "piservod_sent_bytes_total", "counter",
+    "Bytes sent to control clients."
+  );
+  emit(
+    &out, "piservod_sent_bytes_total %llu\n",
+    (unsigned long long) counter_get(&counters.bytes_out)
+  );
+
+  emit_header(
+    &out, "piservod_log_dropped_total", "counter",
+    "Log records dropped because a log ring was full."
+  );
+  emit(&out, "piservod_log_dropped_total %llu\n", (unsigned long long) log_dropped());
+
+  return out.length;
+}
+
+/**
+ * Parse a TCP port, anything else is taken as a socket path
+ */
+static bool parse_port(const char *target, uint16_t *port) {
+  char *end;
+  unsigned long value = strtoul(target, &end, 10);
+
+  if (end == target || *end != '\0' || value == 0 || value > UINT16_MAX) {
+    return false;
+  }
+
+  *port = value;
+  return true;
+}
+
+static int open_listener(const char *target) {
+  uint16_t port;
+  int fd;
+
+  if (parse_port(target, &port)) {
+    struct sockaddr_in addr;
+    int reuse = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("Failed creating metrics socket");
+      return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Loopback only, scrapes from elsewhere go through a local agent
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      perror("Failed binding metrics port");
+      close(fd);
+      return -1;
+    }
+  } else {
+    struct sockaddr_un addr;
+
+    if (strlen(target) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Metrics socket path too long: %s\n", target);
+      return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("Failed creating metrics socket");
+      return -1;
+    }
+
+    unlink(target);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, target, sizeof(addr.sun_path) - 1);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      perror("Failed binding metrics socket");
+      close(fd);
+      return -1;
+    }
+
+    socket_path = strdup(target);
+
+    if (chmod(target, 0666) < 0) {
+      perror("Warning: Failed to set metrics socket permissions");
+    }
+  }
+
+  if (listen(fd, METRICS_MAX_CONNECTIONS) < 0) {
+    perror("Failed listening on metrics socket");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool metrics_open(const char *target, int epoll) {
+  listen_fd = open_listener(target);
+  if (listen_fd < 0) {
+    return false;
+  }
+
+  epoll_fd = epoll;
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+    perror("Failed registering metrics socket");
+    metrics_close();
+    return false;
+  }
+
+  return true;
+}
+
+static void close_connection(MetricsConnection *conn) {
+  // Closing the fd also drops it from the epoll set
+  close(conn->fd);
+  free(conn->response);
+
+  conn->in_use = false;
+  conn->response = NULL;
+}
+
+static void accept_connection(void) {
+  // Make room by dropping the oldest scrape, so idle connections can not
+  // lock out everyone else
+  MetricsConnection *conn = &connections[0];
+  for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+    if (!connections[i].in_use) {
+      conn = &connections[i];
+      break;
+    }
+
+    if (connections[i].serial < conn->serial) {
+      conn = &connections[i];
+    }
+  }
+
+  // An event of the dropped fd may still be pending in this epoll batch,
+  // so its slot is only reused once the listener reports the new
+  // connection again on the next round
+  if (conn->in_use) {
+    close_connection(conn);
+    return;
+  }
+
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  conn->in_use = true;
+  conn->fd = fd;
+  conn->serial = next_serial++;
+  conn->request_len = 0;
+  conn->response_len = 0;
+  conn->sent = 0;
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("Failed registering metrics connection");
+    close_connection(conn);
+  }
+}
+
+/**
+ * Build the reply once the request headers are in, any GET gets the
+ * metrics
+ */
+static bool prepare_response(MetricsConnection *conn) {
+  static const char not_allowed[] =
+    "HTTP/1.0 405 Method Not Allowed\r\n"
+    "Allow: GET\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+  conn->response = malloc(METRICS_RESPONSE_SIZE);
+  if (!conn->response) {
+    return false;
+  }
+
+  if (strncmp(conn->request, "GET ", 4) != 0) {
+    memcpy(conn->response, not_allowed, sizeof(not_allowed) - 1);
+    conn->response_len = sizeof(not_allowed) - 1;
+    return true;
+  }
+
+  // Render behind room for the header, then put the header in front
+  char header[160];
+  size_t offset = sizeof(header);
+  size_t body_len = metrics_render(conn->response + offset, METRICS_RESPONSE_SIZE - offset);
+
+  int header_len = snprintf(
+    header, sizeof(header),
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n\r\n",
+    body_len
+  );
+
+  memmove(conn->response + header_len, conn->response + offset, body_len);
+  memcpy(conn->response, header, header_len);
+  conn->response_len = header_len + body_len;
+
+  return true;
+}
+
+/**
+ * @return false once the connection is done with
+ */
+static bool read_request(MetricsConnection *conn) {
+  ssize_t bytes = read(
+    conn->fd, conn->request + conn->request_len,
+    sizeof(conn->request) - 1 - conn->request_len
+  );
+
+  if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return true;
+  }
+
+  if (bytes <= 0) {
+    return false;
+  }
+
+  conn->request_len += bytes;
+  conn->request[conn->request_len] = '\0';
+
+  // Wait for the end of the headers, a request that never ends is
+  // answered once the buffer is full
+  if (
+    !strstr(conn->request, "\r\n\r\n") &&
+    !strstr(conn->request, "\n\n") &&
+    conn->request_len < sizeof(conn->request) - 1
+  ) {
+    return true;
+  }
+
+  if (!prepare_response(conn)) {
+    return false;
+  }
+
+  struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = conn};
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0;
+}
+
+/**
+ * @return false once the connection is done with
+ */
+static bool write_response(MetricsConnection *conn) {
+  while (conn->sent < conn->response_len) {
+    ssize_t written = write(
+      conn->fd, conn->response + conn->sent, conn->response_len - conn->sent
+    );
+
+    if (written < 0) {
+      return errno == EAGAIN || errno == EINTR;
+    }
+
+    conn->sent += written;
+  }
+
+  return false;
+}
+
+bool metrics_handle_event(void *ptr, uint32_t events) {
+  if (listen_fd < 0) {
+    return false;
+  }
+
+  if (ptr == &listen_fd) {
+    accept_connection();
+    return true;
+  }
+
+  MetricsConnection *conn = ptr;
+  if (conn < connections || conn >= connections + METRICS_MAX_CONNECTIONS) {
+    return false;
+  }
+
+  // Left over from a connection dropped earlier in the same epoll batch
+  if (!conn->in_use) {
+    return true;
+  }
+
+  bool open;
+  if (conn->response) {
+    open = write_response(conn);
+  } else {
+    open = !(events & EPOLLERR) && read_request(conn);
+  }
+
+  if (!open) {
+    close_connection(conn);
+  }
+
+  return true;
+}
+
+void metrics_close(void) {
+  for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+    if (connections[i].in_use) {
+      close_connection(&connections[i]);
+    }
+  }
+
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    listen_fd = -1;
+  }
+
+  if (socket_path) {
+    unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+  }
+}
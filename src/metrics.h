@@ -0,0 +1,47 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Prometheus metrics, served over HTTP/1.0 on a Unix socket or a loopback
+ * TCP port. The socket side counters are relaxed atomics, PWM counters
+ * come from the stats module's running totals.
+ */
+
+// Count a command, rejected if it was answered with an error
+void metrics_count_command(CommandType type, bool rejected);
+void metrics_add_bytes_in(size_t bytes);
+void metrics_add_bytes_out(size_t bytes);
+void metrics_set_clients(size_t clients);
+
+/**
+ * Render every metric in the Prometheus text exposition format
+ *
+ * @return Number of bytes written, at most buffer_size - 1
+ */
+size_t metrics_render(char *buffer, size_t buffer_size);
+
+/**
+ * Listen for scrapes and register the socket with an epoll set
+ *
+ * @param target A port number for 127.0.0.1, anything else is a Unix
+ *               socket path
+ */
+bool metrics_open(const char *target, int epoll_fd);
+
+/**
+ * Handle an epoll event if it belongs to the metrics endpoint
+ *
+ * @return false if the event is not a metrics one
+ */
+bool metrics_handle_event(void *ptr, uint32_t events);
+
+// Close the listener and every pending scrape
+void metrics_close(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,93 @@
+#include "motion.h"
+#include "servo.h"
+
+#define Q16(us) ((int32_t) (us) * 65536)
+
+static uint64_t isqrt64(uint64_t value) {
+  uint64_t root = 0;
+  uint64_t bit = 1ULL << 62;
+
+  while (bit > value) {
+    bit >>= 2;
+  }
+
+  while (bit) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+
+    bit >>= 2;
+  }
+
+  return root;
+}
+
+static int16_t motion_pulse(const Motion *motion) {
+  return (motion->position + (1 << 15)) >> 16;
+}
+
+void motion_start(
+  Motion *motion, int16_t from_us, int16_t target_us,
+  uint32_t vel_us_s, uint32_t acc_us_s2
+) {
+  if (!motion->active) {
+    motion->position = Q16(from_us);
+    motion->velocity = 0;
+  }
+
+  motion->target = Q16(target_us);
+
+  // Per second to per frame, rounded up so tiny limits still move
+  int64_t frames = PWM_FREQUENCY_HZ;
+  motion->max_velocity = ((int64_t) vel_us_s * 65536 + frames - 1) / frames;
+  motion->acceleration = ((int64_t) acc_us_s2 * 65536 + frames * frames - 1) / (frames * frames);
+  motion->active = true;
+}
+
+void motion_stop(Motion *motion) {
+  motion->active = false;
+  motion->velocity = 0;
+}
+
+int16_t motion_step(Motion *motion) {
+  if (!motion->active) {
+    return motion_pulse(motion);
+  }
+
+  int64_t distance = (int64_t) motion->target - motion->position;
+  int64_t remaining = distance < 0 ? -distance : distance;
+
+  // Fastest speed that can still stop at the target, capped by the limit
+  int64_t speed = isqrt64(2 * (uint64_t) motion->acceleration * remaining);
+  if (speed > motion->max_velocity) {
+    speed = motion->max_velocity;
+  }
+
+  int64_t desired = distance < 0 ? -speed : speed;
+  int64_t velocity = motion->velocity;
+
+  if (velocity < desired) {
+    velocity = velocity + motion->acceleration < desired ? velocity + motion->acceleration : desired;
+  } else {
+    velocity = velocity - motion->acceleration > desired ? velocity - motion->acceleration : desired;
+  }
+
+  int64_t position = motion->position + velocity;
+
+  // Arrive instead of overshooting
+  if (
+    (distance >= 0 && position >= motion->target) ||
+    (distance <= 0 && position <= motion->target)
+  ) {
+    motion->position = motion->target;
+    motion_stop(motion);
+  } else {
+    motion->position = position;
+    motion->velocity = velocity;
+  }
+
+  return motion_pulse(motion);
+}
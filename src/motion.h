@@ -0,0 +1,35 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Trapezoidal motion profile, stepped once per PWM frame by the PWM thread.
+ * Positions are Q16.16 microseconds, velocities are per frame and
+ * accelerations per frame squared, so a step is a few integer operations.
+ */
+typedef struct {
+  bool    active;
+  int32_t position;      // Q16.16 us
+  int32_t velocity;      // Q16.16 us per frame, signed
+  int32_t target;        // Q16.16 us
+  int32_t max_velocity;  // Q16.16 us per frame
+  int32_t acceleration;  // Q16.16 us per frame^2
+} Motion;
+
+/**
+ * Start a move from the current pulse
+ *
+ * A move that is already running keeps its velocity, so retargeting does
+ * not jerk the servo.
+ */
+void motion_start(
+  Motion *motion, int16_t from_us, int16_t target_us,
+  uint32_t vel_us_s, uint32_t acc_us_s2
+);
+void motion_stop(Motion *motion);
+// Advance one frame and return the pulse for it
+int16_t motion_step(Motion *motion);
+
+#endif /* MOTION_H */
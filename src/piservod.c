@@ -6,28 +6,135 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include "pwm.h"
 #include "gpio.h"
+#include "keyframe.h"
+#include "log.h"
+#include "metrics.h"
 #include "protocol.h"
+#include "rt.h"
 #include "servo.h"
+#include "shm.h"
+#include "stats.h"
+#include "timebase.h"
+#include "watch.h"
 
-#define MAX_CLIENTS 10
 #define BACKLOG 5
+#define MAX_EVENTS 32
+#define INITIAL_CLIENT_CAPACITY 8
+#define MAX_BATCH_COMMANDS 128
+// Output ring per client, must be a power of two
+#define CLIENT_OUTPUT_SIZE 16384
+#define CLIENT_DEFAULT_BURST 16
+// Longest GET CLIENTS line
+#define CLIENT_REPORT_LENGTH 192
+// Longest OVERRUN line of GET OVERRUNS
+#define OVERRUN_REPORT_LENGTH 128
+#define MAX_PREFAULT_STACK_KB 4096
+#define MAX_PREFAULT_HEAP_KB (1024 * 1024)
 
 // Global state
 static ServoController controller;
 static int listen_fd = -1;
 static volatile sig_atomic_t running = 1;
-
-// Client connection tracking
-static int client_fds[MAX_CLIENTS];
-static char client_buffers[MAX_CLIENTS][MAX_COMMAND_LENGTH];
-static size_t client_buffer_lens[MAX_CLIENTS];
+static const char *replay_path = NULL;
+static const char *socket_path = SOCKET_PATH;
+static const char *shm_name = NULL;
+static const char *metrics_target = NULL;
+static const char *log_target = "stderr";
+
+// Fairness limits, 0 leaves them off
+static unsigned cmd_budget = 0;    // Commands per frame over all clients
+static unsigned client_rate = 0;   // Commands per second per client
+static unsigned client_burst = CLIENT_DEFAULT_BURST;
+
+// Memory setup for the real-time path
+static bool lock_memory = false;
+static size_t prefault_heap = 0;
+
+// Channel changes staged between BEGIN and COMMIT
+typedef struct {
+  Command commands[MAX_BATCH_COMMANDS];
+  int     count;
+  int     lines;        // Commands received, staged or not
+  int     failed_line;  // First rejected command, 0 if none
+  char    error[MAX_ERROR_MESSAGE];
+} Batch;
+
+typedef struct {
+  uint64_t commands;   // Commands run
+  uint64_t throttled;  // Commands held back by the client's rate limit
+  uint64_t deferred;   // Commands held back by the per-frame budget
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} ClientCounters;
+
+// Client connection tracking, the epoll data of each client fd points at
+// its Client, the listening socket is registered with NULL and the frame
+// tick with &tick_fd
+typedef struct {
+  int fd;
+  unsigned id;
+  bool binary;
+  bool closing;  // Removed once the current pass over the clients is done
+  Batch *batch;  // NULL outside a transaction
+  Watch *watch;  // NULL unless the client watches channels
+  // Input, commands before buffer_start already ran
+  char buffer[MAX_COMMAND_LENGTH];
+  size_t buffer_start;
+  size_t buffer_len;
+  uint32_t events;  // What the fd is registered for in epoll
+  bool paused;      // Input is left unread until the buffered commands ran
+  // Token bucket of the rate limit, in nanoseconds worth of commands
+  uint64_t credit_ns;
+  uint64_t refill_ns;
+  bool throttled;   // Front command already counted as throttled
+  bool deferred;    // Front command already counted as deferred
+  ClientCounters counters;
+  // Responses not yet taken by the socket, head and tail run freely
+  char output[CLIENT_OUTPUT_SIZE];
+  uint32_t output_head;
+  uint32_t output_tail;
+} Client;
+
+_Static_assert(
+  BINARY_SET_ALL_SIZE <= MAX_COMMAND_LENGTH,
+  "client buffer must hold the largest binary message"
+);
+_Static_assert(
+  (CLIENT_OUTPUT_SIZE & (CLIENT_OUTPUT_SIZE - 1)) == 0 &&
+  CLIENT_OUTPUT_SIZE >= WATCH_OUTPUT_SIZE + MAX_RESPONSE_LENGTH,
+  "output ring must be a power of two holding a notification and a response"
+);
+
+static int epoll_fd = -1;
+static Client **clients = NULL;
+static size_t num_clients = 0;
+static size_t client_capacity = 0;
+static unsigned next_client_id = 0;
+
+// Ticks once per frame while anyone watches channels or commands are held
+// back by the fairness limits
+static int tick_fd = -1;
+static bool tick_armed = false;
+
+// Commands left in the current frame's budget
+static unsigned budget_left = 0;
+static uint64_t budget_frame = 0;
+// Where the next round-robin pass over the clients starts
+static size_t next_serviced = 0;
+
+// Signal mask while waiting for events, SIGINT/SIGTERM are blocked otherwise
+static sigset_t wait_mask;
 
 static void signal_handler(int signo) {
   (void)signo;
@@ -54,6 +161,21 @@ static bool setup_signals(void) {
   // Ignore SIGPIPE (client disconnect)
   signal(SIGPIPE, SIG_IGN);
 
+  // Only deliver shutdown signals inside epoll_pwait(), so one arriving
+  // right before the wait cannot leave the loop blocked
+  sigset_t block;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+
+  if (sigprocmask(SIG_BLOCK, &block, &wait_mask) < 0) {
+    perror("sigprocmask failed");
+    return false;
+  }
+
+  sigdelset(&wait_mask, SIGINT);
+  sigdelset(&wait_mask, SIGTERM);
+
   return true;
 }
 
@@ -68,12 +190,12 @@ static int create_socket(void) {
   }
 
   // Remove old socket file if it exists
-  unlink(SOCKET_PATH);
+  unlink(socket_path);
 
   // Setup address and create new socket file
   memset(&addr, 0, sizeof(addr));
   addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
 
   if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
     perror("Failed binding to the socket");
@@ -85,139 +207,471 @@ static int create_socket(void) {
   if (listen(fd, BACKLOG) < 0) {
     perror("Failed listening to socket");
     close(fd);
-    unlink(SOCKET_PATH);
+    unlink(socket_path);
 
     return -1;
   }
 
   // Make socket accessible to all users
-  if (chmod(SOCKET_PATH, 0666) < 0) {
+  if (chmod(socket_path, 0666) < 0) {
     perror("Warning: Failed to set socket permissions");
   }
 
-  printf("Listening on %s\n", SOCKET_PATH);
+  printf("Listening on %s\n", socket_path);
   return fd;
 }
 
-static void init_clients(void) {
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    client_fds[i] = -1;
-    client_buffer_lens[i] = 0;
+static bool add_client(int fd) {
+  if (num_clients == client_capacity) {
+    size_t capacity = client_capacity ? client_capacity * 2 : INITIAL_CLIENT_CAPACITY;
+    Client **grown = realloc(clients, capacity * sizeof(Client *));
+    if (!grown) {
+      return false;
+    }
+
+    clients = grown;
+    client_capacity = capacity;
+  }
+
+  Client *client = calloc(1, sizeof(Client));
+  if (!client) {
+    return false;
+  }
+
+  client->fd = fd;
+  client->id = next_client_id++;
+  client->events = EPOLLIN;
+  client->credit_ns = (uint64_t) client_burst * NS_PER_SEC / (client_rate ? client_rate : 1);
+  client->refill_ns = timebase_now_ns();
+
+  struct epoll_event ev = {.events = client->events, .data.ptr = client};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("Failed registering client");
+    free(client);
+
+    return false;
   }
+
+  clients[num_clients++] = client;
+  metrics_set_clients(num_clients);
+  log_push(LOG_CLIENT_CONNECTED, client->id, num_clients);
+
+  return true;
 }
 
-static bool add_client(int fd) {
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (client_fds[i] == -1) {
-      client_fds[i] = fd;
-      client_buffer_lens[i] = 0;
-      printf("Client connected (slot %d)\n", i);
+static void remove_client(Client *client) {
+  for (size_t i = 0; i < num_clients; i++) {
+    if (clients[i] == client) {
+      clients[i] = clients[--num_clients];
+      break;
+    }
+  }
 
-      return true;
+  metrics_set_clients(num_clients);
+
+  // Closing the fd also drops it from the epoll set
+  close(client->fd);
+  log_push(LOG_CLIENT_DISCONNECTED, client->id, num_clients);
+  free(client->batch);
+  free(client->watch);
+  free(client);
+}
+
+static void accept_clients(void) {
+  int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client_fd < 0) {
+    if (errno != EINTR && errno != EAGAIN) {
+      perror("Failed accepting client");
     }
+
+    return;
+  }
+
+  if (!add_client(client_fd)) {
+    fprintf(stderr, "Out of memory, rejecting connection\n");
+    close(client_fd);
   }
+}
 
-  return false;
+static size_t output_pending(const Client *client) {
+  return client->output_head - client->output_tail;
 }
 
-static void remove_client(int slot) {
-  if (slot >= 0 && slot < MAX_CLIENTS && client_fds[slot] != -1) {
-    close(client_fds[slot]);
-    client_fds[slot] = -1;
-    client_buffer_lens[slot] = 0;
+static size_t output_space(const Client *client) {
+  return CLIENT_OUTPUT_SIZE - output_pending(client);
+}
+
+/**
+ * Register for what the client is waiting on: input unless paused, and
+ * writability while output is pending
+ */
+static void update_client_events(Client *client) {
+  uint32_t events = (client->paused ? 0 : EPOLLIN) | (output_pending(client) ? EPOLLOUT : 0);
+
+  if (epoll_fd < 0 || events == client->events) {
+    return;
+  }
 
-    printf("Client disconnected (slot %d)\n", slot);
+  struct epoll_event ev = {.events = events, .data.ptr = client};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) < 0) {
+    perror("Failed updating client events");
+    return;
   }
+
+  client->events = events;
 }
 
-static void handle_command(int client_fd, const char *buffer) {
-  Command cmd;
-  Response resp;
-  char resp_buffer[MAX_RESPONSE_LENGTH];
+/**
+ * Write as much pending output as the socket takes
+ *
+ * @return false if the connection failed
+ */
+static bool flush_output(Client *client) {
+  while (output_pending(client) > 0) {
+    uint32_t start = client->output_tail & (CLIENT_OUTPUT_SIZE - 1);
+    size_t length = output_pending(client);
+    if (length > CLIENT_OUTPUT_SIZE - start) {
+      length = CLIENT_OUTPUT_SIZE - start;
+    }
 
-  if (!parse_command(buffer, &cmd)) {
-    resp.type = RESP_ERROR;
-    snprintf(resp.data.error.message, MAX_ERROR_MESSAGE, "Invalid command");
-    format_response(&resp, resp_buffer, sizeof(resp_buffer));
-    write(client_fd, resp_buffer, strlen(resp_buffer));
+    ssize_t written = write(client->fd, client->output + start, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
 
+    client->output_tail += written;
+    client->counters.bytes_out += written;
+    metrics_add_bytes_out(written);
+  }
+
+  return true;
+}
+
+/**
+ * Queue output for a client and send what the socket takes right away
+ *
+ * Never blocks. Callers make sure there is room, see output_space(); a
+ * write that does not fit is dropped. A failed connection is only marked,
+ * it is removed once the current pass over the clients is done.
+ */
+static void client_send(Client *client, const void *data, size_t length) {
+  if (length > output_space(client)) {
     return;
   }
 
-  if (cmd.channel >= MAX_SERVO_CHANNELS) {
-    resp.type = RESP_ERROR;
-    snprintf(resp.data.error.message, MAX_ERROR_MESSAGE, "Invalid channel");
-    format_response(&resp, resp_buffer, sizeof(resp_buffer));
-    write(client_fd, resp_buffer, strlen(resp_buffer));
+  for (size_t done = 0; done < length;) {
+    uint32_t start = client->output_head & (CLIENT_OUTPUT_SIZE - 1);
+    size_t chunk = length - done;
+    if (chunk > CLIENT_OUTPUT_SIZE - start) {
+      chunk = CLIENT_OUTPUT_SIZE - start;
+    }
+
+    memcpy(client->output + start, (const char *) data + done, chunk);
+    client->output_head += chunk;
+    done += chunk;
+  }
+
+  if (!flush_output(client)) {
+    client->output_tail = client->output_head;
+    client->closing = true;
+  }
+
+  update_client_events(client);
+}
+
+/**
+ * Shard with the least work for a channel being enabled, counted as the
+ * sum of the frame rates of the channels already enabled on each shard
+ */
+static uint8_t pick_shard(const ServoController *target, uint8_t channel) {
+  uint32_t load[PWM_MAX_SHARDS] = {0};
+  unsigned num_shards = pwm_num_shards();
+
+  for (uint8_t i = 0; i < target->num_channels; i++) {
+    const ServoChannel *other = &target->channels[i];
+
+    if (i == channel || !other->enabled || other->shard >= num_shards) {
+      continue;
+    }
+
+    load[other->shard] += other->rate_hz ? other->rate_hz : PWM_FREQUENCY_HZ;
+  }
+
+  uint8_t best = 0;
+  for (uint8_t i = 1; i < num_shards; i++) {
+    if (load[i] < load[best]) {
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Apply a parsed command to a channel table and build its response
+ *
+ * Only touches the table, hardware setup and publishing are up to the
+ * caller, see apply_command().
+ */
+static void execute_command(
+  ServoController *target, const Command *cmd, Response *resp
+) {
+  if (cmd->channel >= MAX_SERVO_CHANNELS) {
+    resp->type = RESP_ERROR;
+    snprintf(resp->data.error.message, MAX_ERROR_MESSAGE, "Invalid channel");
 
     return;
   }
 
-  ServoChannel *ch = &controller.channels[cmd.channel];
+  ServoChannel *ch = &target->channels[cmd->channel];
 
-  switch (cmd.type) {
+  switch (cmd->type) {
     case CMD_SETUP: {
-      if (cmd.data.setup.gpio > MAX_GPIO_PIN) {
-        resp.type = RESP_ERROR;
+      if (cmd->data.setup.gpio > MAX_GPIO_PIN) {
+        resp->type = RESP_ERROR;
         snprintf(
-          resp.data.error.message, MAX_ERROR_MESSAGE,
+          resp->data.error.message, MAX_ERROR_MESSAGE,
           "Invalid GPIO pin"
         );
 
         break;
       }
 
-      ch->gpio = cmd.data.setup.gpio;
+      ch->gpio = cmd->data.setup.gpio;
       ch->pulse_us = SERVO_NEUTRAL_US;
+      ch->pulse_gen++;
       ch->min_us = SERVO_MIN_US;
       ch->max_us = SERVO_MAX_US;
+      ch->rate_hz = PWM_FREQUENCY_HZ;
       ch->enabled = false;
-      resp.type = RESP_OK;
-
-      gpio_set_output(ch->gpio);
+      resp->type = RESP_OK;
     } break;
 
     case CMD_ENABLE: {
       if (ch->gpio == 0) {
-        resp.type = RESP_ERROR;
+        resp->type = RESP_ERROR;
         snprintf(
-          resp.data.error.message, MAX_ERROR_MESSAGE,
+          resp->data.error.message, MAX_ERROR_MESSAGE,
           "Channel not configured"
         );
 
         break;
       }
 
+      if (!ch->enabled && !ch->shard_fixed) {
+        ch->shard = pick_shard(target, cmd->channel);
+      }
+
       ch->enabled = true;
-      resp.type = RESP_OK;
+      resp->type = RESP_OK;
     } break;
 
     case CMD_DISABLE: {
       ch->enabled = false;
-      resp.type = RESP_OK;
+      resp->type = RESP_OK;
     } break;
 
     case CMD_SET_RANGE: {
-      if (cmd.data.range.min >= cmd.data.range.max) {
-        resp.type = RESP_ERROR;
+      if (cmd->data.range.min >= cmd->data.range.max) {
+        resp->type = RESP_ERROR;
         snprintf(
-          resp.data.error.message, MAX_ERROR_MESSAGE,
+          resp->data.error.message, MAX_ERROR_MESSAGE,
           "Invalid range: min must be less than max"
         );
 
         break;
       }
 
-      ch->min_us = cmd.data.range.min;
-      ch->max_us = cmd.data.range.max;
-      resp.type = RESP_OK;
+      // Anything wider would spill into the next slot
+      if (
+        cmd->data.range.min < SERVO_ABSOLUTE_MIN ||
+        cmd->data.range.max > SERVO_ABSOLUTE_MAX
+      ) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid range: outside %d-%d",
+          SERVO_ABSOLUTE_MIN, SERVO_ABSOLUTE_MAX
+        );
+
+        break;
+      }
+
+      // The output has to drop before the next period starts
+      if (cmd->data.range.max >= servo_period_us(ch)) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid range: max must be below the %u us period",
+          (unsigned) servo_period_us(ch)
+        );
+
+        break;
+      }
+
+      ch->min_us = cmd->data.range.min;
+      ch->max_us = cmd->data.range.max;
+      resp->type = RESP_OK;
+    } break;
+
+    case CMD_SET_RATE: {
+      if (ch->gpio == 0) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Channel not configured"
+        );
+
+        break;
+      }
+
+      uint16_t hz = cmd->data.rate.hz;
+      if (hz < SERVO_MIN_RATE_HZ || hz > SERVO_MAX_RATE_HZ) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid rate: outside %d-%d Hz", SERVO_MIN_RATE_HZ, SERVO_MAX_RATE_HZ
+        );
+
+        break;
+      }
+
+      if (ch->max_us >= SERVO_PERIOD_US(hz)) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid rate: range max must be below the %u us period",
+          (unsigned) SERVO_PERIOD_US(hz)
+        );
+
+        break;
+      }
+
+      ch->rate_hz = hz;
+      resp->type = RESP_OK;
+    } break;
+
+    case CMD_GET_RATE: {
+      resp->type = RESP_RATE;
+      resp->data.rate.hz = ch->rate_hz ? ch->rate_hz : PWM_FREQUENCY_HZ;
+    } break;
+
+    case CMD_SET_SHARD: {
+      uint8_t index = cmd->data.shard.index;
+
+      if (index != SHARD_AUTO && index >= pwm_num_shards()) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid shard: outside 0-%u", pwm_num_shards() - 1
+        );
+
+        break;
+      }
+
+      // Two threads must never drive the same pin within a frame
+      if (ch->enabled) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Disable the channel before moving it"
+        );
+
+        break;
+      }
+
+      ch->shard_fixed = index != SHARD_AUTO;
+      ch->shard = ch->shard_fixed ? index : 0;
+      resp->type = RESP_OK;
+    } break;
+
+    case CMD_GET_SHARD: {
+      resp->type = RESP_SHARD;
+      resp->data.shard.index = ch->shard < pwm_num_shards() ? ch->shard : 0;
     } break;
 
     case CMD_SET_PULSE: {
       if (ch->gpio == 0) {
-        resp.type = RESP_ERROR;
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Channel not configured"
+        );
+
+        break;
+      }
+
+      if (
+        cmd->data.pulse.value < ch->min_us ||
+        cmd->data.pulse.value > ch->max_us
+      ) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Pulse value out of range"
+        );
+
+        break;
+      }
+
+      ch->pulse_us = cmd->data.pulse.value;
+      ch->pulse_gen++;
+      resp->type = RESP_OK;
+    } break;
+
+    case CMD_MOVE: {
+      if (ch->gpio == 0) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Channel not configured"
+        );
+
+        break;
+      }
+
+      if (
+        cmd->data.move.target < ch->min_us ||
+        cmd->data.move.target > ch->max_us
+      ) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Pulse value out of range"
+        );
+
+        break;
+      }
+
+      if (
+        cmd->data.move.vel == 0 || cmd->data.move.vel > SERVO_MAX_VEL ||
+        cmd->data.move.acc == 0 || cmd->data.move.acc > SERVO_MAX_ACC
+      ) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid move: VEL 1-%d, ACC 1-%d", SERVO_MAX_VEL, SERVO_MAX_ACC
+        );
+
+        break;
+      }
+
+      ch->move.target_us = cmd->data.move.target;
+      ch->move.vel_us_s = cmd->data.move.vel;
+      ch->move.acc_us_s2 = cmd->data.move.acc;
+      ch->move.gen++;
+      resp->type = RESP_OK;
+    } break;
+
+    case CMD_KEYFRAME: {
+      if (ch->gpio == 0) {
+        resp->type = RESP_ERROR;
         snprintf(
-          resp.data.error.message, MAX_ERROR_MESSAGE,
+          resp->data.error.message, MAX_ERROR_MESSAGE,
           "Channel not configured"
         );
 
@@ -225,190 +679,1532 @@ static void handle_command(int client_fd, const char *buffer) {
       }
 
       if (
-        cmd.data.pulse.value < ch->min_us ||
-        cmd.data.pulse.value > ch->max_us
+        cmd->data.keyframe.pulse < ch->min_us ||
+        cmd->data.keyframe.pulse > ch->max_us
       ) {
-        resp.type = RESP_ERROR;
+        resp->type = RESP_ERROR;
         snprintf(
-          resp.data.error.message, MAX_ERROR_MESSAGE,
+          resp->data.error.message, MAX_ERROR_MESSAGE,
           "Pulse value out of range"
         );
 
         break;
       }
 
-      ch->pulse_us = cmd.data.pulse.value;
-      resp.type = RESP_OK;
+      KeyframeResult result = keyframe_push(
+        cmd->channel, cmd->data.keyframe.at_ms, cmd->data.keyframe.pulse
+      );
+
+      switch (result) {
+        case KEYFRAME_OK: {
+          resp->type = RESP_OK;
+        } break;
+
+        case KEYFRAME_FULL: {
+          resp->type = RESP_ERROR;
+          snprintf(
+            resp->data.error.message, MAX_ERROR_MESSAGE,
+            "Keyframe queue full"
+          );
+        } break;
+
+        case KEYFRAME_OUT_OF_ORDER: {
+          resp->type = RESP_ERROR;
+          snprintf(
+            resp->data.error.message, MAX_ERROR_MESSAGE,
+            "Keyframes must be added in time order"
+          );
+        } break;
+      }
+    } break;
+
+    case CMD_PLAY: {
+      if (!keyframe_play(pwm_common_frame())) {
+        resp->type = RESP_ERROR;
+        snprintf(resp->data.error.message, MAX_ERROR_MESSAGE, "Already playing");
+
+        break;
+      }
+
+      resp->type = RESP_OK;
+    } break;
+
+    case CMD_STOP: {
+      keyframe_stop();
+      resp->type = RESP_OK;
     } break;
 
     case CMD_GET_RANGE: {
-      resp.type = RESP_RANGE;
-      resp.data.range.min = ch->min_us;
-      resp.data.range.max = ch->max_us;
+      resp->type = RESP_RANGE;
+      resp->data.range.min = ch->min_us;
+      resp->data.range.max = ch->max_us;
     } break;
 
     case CMD_GET_PULSE: {
-      resp.type = RESP_PULSE;
-      resp.data.pulse.value = ch->pulse_us;
+      resp->type = RESP_PULSE;
+      resp->data.pulse.value = pwm_current_pulse(target, cmd->channel);
     } break;
 
     case CMD_GET_STATE: {
-      resp.type = RESP_STATE;
-      resp.data.state.gpio = ch->gpio;
-      resp.data.state.enabled = ch->enabled;
+      resp->type = RESP_STATE;
+      resp->data.state.gpio = ch->gpio;
+      resp->data.state.enabled = ch->enabled;
     } break;
 
-    default: {
-      resp.type = RESP_ERROR;
-      snprintf(resp.data.error.message, MAX_ERROR_MESSAGE, "Unknown command");
+    case CMD_GET_STATS: {
+      StatsFrameSummary summary;
+      stats_frame_summary(&summary);
+
+      resp->type = RESP_STATS;
+      resp->data.stats.frames = summary.frames;
+      resp->data.stats.overruns = summary.overruns;
+      resp->data.stats.wakeups = summary.wakeups;
+      resp->data.stats.late_wakeups = summary.late_wakeups;
+      resp->data.stats.p50_us = summary.lateness.p50_us;
+      resp->data.stats.p99_us = summary.lateness.p99_us;
+      resp->data.stats.max_us = summary.lateness.max_us;
     } break;
-  }
 
-  format_response(&resp, resp_buffer, sizeof(resp_buffer));
-  write(client_fd, resp_buffer, strlen(resp_buffer));
-}
+    case CMD_GET_CHANNEL_STATS: {
+      StatsSummary summary;
+      stats_channel_summary(cmd->channel, &summary);
 
-static void handle_client_data(int slot) {
-  char temp_buffer[MAX_COMMAND_LENGTH];
-  ssize_t bytes_read;
-
-  bytes_read = read(client_fds[slot], temp_buffer, sizeof(temp_buffer) - 1);
+      resp->type = RESP_CHANNEL_STATS;
+      resp->data.stats.edges = summary.count;
+      resp->data.stats.p50_us = summary.p50_us;
+      resp->data.stats.p99_us = summary.p99_us;
+      resp->data.stats.max_us = summary.max_us;
+    } break;
 
-  // Client disconnected or error
-  if (bytes_read <= 0) {
-    remove_client(slot);
-    return;
-  }
+    case CMD_RESET_STATS: {
+      stats_request_reset();
+      resp->type = RESP_OK;
+    } break;
 
-  temp_buffer[bytes_read] = '\0';
+    case CMD_SET_ALL_PULSE: {
+      // Check every channel first, a bad entry leaves all of them unchanged
+      int bad = -1;
+      for (int i = 0; i < MAX_SERVO_CHANNELS && bad < 0; i++) {
+        uint16_t value = cmd->data.all.pulses[i];
+        ServoChannel *c = &target->channels[i];
+
+        if (
+          value != PULSE_UNCHANGED &&
+          (c->gpio == 0 || value < c->min_us || value > c->max_us)
+        ) {
+          bad = i;
+        }
+      }
 
-  // Append to client's buffer
-  size_t available = MAX_COMMAND_LENGTH - client_buffer_lens[slot] - 1;
-  size_t to_copy = bytes_read < (ssize_t) available ? (size_t) bytes_read : available;
+      if (bad >= 0) {
+        resp->type = RESP_ERROR;
+        snprintf(
+          resp->data.error.message, MAX_ERROR_MESSAGE,
+          "Invalid pulse for channel %d", bad
+        );
 
-  memcpy(client_buffers[slot] + client_buffer_lens[slot], temp_buffer, to_copy);
-  client_buffer_lens[slot] += to_copy;
-  client_buffers[slot][client_buffer_lens[slot]] = '\0';
+        break;
+      }
 
-  // Process complete commands (lines ending with \n)
-  char *line_start = client_buffers[slot];
-  char *newline;
+      for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+        if (cmd->data.all.pulses[i] != PULSE_UNCHANGED) {
+          target->channels[i].pulse_us = cmd->data.all.pulses[i];
+          target->channels[i].pulse_gen++;
+        }
+      }
 
-  while ((newline = strchr(line_start, '\n')) != NULL) {
-    *newline = '\0';
-    handle_command(client_fds[slot], line_start);
-    line_start = newline + 1;
-  }
+      resp->type = RESP_OK;
+    } break;
 
-  // Move remaining incomplete data to start of buffer
-  size_t remaining = strlen(line_start);
-  if (remaining > 0 && line_start != client_buffers[slot]) {
-    memmove(client_buffers[slot], line_start, remaining + 1);
+    default: {
+      resp->type = RESP_ERROR;
+      snprintf(resp->data.error.message, MAX_ERROR_MESSAGE, "Unknown command");
+    } break;
   }
 
-  client_buffer_lens[slot] = remaining;
 }
 
-int main(void) {
-  fd_set read_fds;
-  struct timeval tv;
-  int max_fd;
+/**
+ * Whether a command changes the channel table
+ */
+static bool command_changes_channels(CommandType type) {
+  switch (type) {
+    case CMD_SETUP:
+    case CMD_ENABLE:
+    case CMD_DISABLE:
+    case CMD_SET_RANGE:
+    case CMD_SET_PULSE:
+    case CMD_SET_ALL_PULSE:
+    case CMD_MOVE:
+    case CMD_SET_RATE:
+    case CMD_SET_SHARD:
+      return true;
 
-  printf("Starting servo daemon...\n");
+    default:
+      return false;
+  }
+}
 
-  memset(&controller, 0, sizeof(controller));
-  controller.num_channels = MAX_SERVO_CHANNELS;
+/**
+ * Run a command against the live table and hand changes to the PWM thread
+ */
+static void apply_command(const Command *cmd, Response *resp) {
+  execute_command(&controller, cmd, resp);
 
-  init_clients();
+  if (resp->type != RESP_OK || !command_changes_channels(cmd->type)) {
+    return;
+  }
 
-  if (!gpio_init()) {
-    fprintf(stderr, "Failed to initialize GPIO\n");
-    return 1;
+  if (cmd->type == CMD_SETUP) {
+    gpio_set_output(cmd->data.setup.gpio);
   }
 
-  if (!pwm_init(&controller)) {
-    fprintf(stderr, "Failed to initialize PWM\n");
-    gpio_cleanup();
-    return 1;
+  pwm_publish(&controller);
+}
+
+/**
+ * Stage a command between BEGIN and COMMIT
+ *
+ * Nothing is answered until COMMIT, so a rejected command only marks the
+ * batch as failed.
+ *
+ * @param cmd NULL for a line that did not parse
+ */
+static void stage_command(Batch *batch, const Command *cmd) {
+  batch->lines++;
+
+  if (batch->failed_line) {
+    return;
   }
 
-  if (!setup_signals()) {
-    fprintf(stderr, "Failed to setup signal handlers\n");
-    pwm_cleanup();
-    gpio_cleanup();
-    return 1;
+  const char *error = NULL;
+  if (!cmd) {
+    error = "Invalid command";
+  } else if (!command_changes_channels(cmd->type)) {
+    error = "Not allowed in a batch";
+  } else if (batch->count == MAX_BATCH_COMMANDS) {
+    error = "Batch too large";
   }
 
-  listen_fd = create_socket();
-  if (listen_fd < 0) {
-    pwm_cleanup();
-    gpio_cleanup();
-    return 1;
+  if (error) {
+    batch->failed_line = batch->lines;
+    snprintf(batch->error, sizeof(batch->error), "%s", error);
+    return;
   }
 
-  printf("Servo daemon running\n");
+  batch->commands[batch->count++] = *cmd;
+}
 
-  while (running) {
-    pwm_run_frame(&controller);
-
-    // Setup fd_set for select
-    FD_ZERO(&read_fds);
-    FD_SET(listen_fd, &read_fds);
-    max_fd = listen_fd;
-
-    // Add all active client connections
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-      if (client_fds[i] != -1) {
-        FD_SET(client_fds[i], &read_fds);
-        if (client_fds[i] > max_fd) {
-          max_fd = client_fds[i];
-        }
-      }
-    }
+/**
+ * Apply a batch as a whole
+ *
+ * Every command runs against a scratch copy of the table first, only if all
+ * of them succeed the copy replaces the table and is published once, so the
+ * PWM thread picks up the entire batch in the same frame.
+ */
+static void commit_batch(Batch *batch, Response *resp) {
+  static ServoController scratch;
+  Response result;
+
+  if (batch->failed_line) {
+    resp->type = RESP_ERROR;
+    snprintf(
+      resp->data.error.message, MAX_ERROR_MESSAGE,
+      "Command %d: %.100s", batch->failed_line, batch->error
+    );
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
+    return;
+  }
 
-    int ready = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
-    if (ready > 0) {
-      if (FD_ISSET(listen_fd, &read_fds)) {
-        int client_fd = accept(listen_fd, NULL, NULL);
-        if (client_fd >= 0) {
-          if (!add_client(client_fd)) {
-            fprintf(stderr, "Too many clients, rejecting connection\n");
-            close(client_fd);
-          }
-        }
-      }
+  scratch = controller;
 
-      // Check for data from existing clients
-      for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_fds[i] != -1 && FD_ISSET(client_fds[i], &read_fds)) {
-          handle_client_data(i);
-        }
-      }
+  for (int i = 0; i < batch->count; i++) {
+    execute_command(&scratch, &batch->commands[i], &result);
+
+    if (result.type != RESP_OK) {
+      resp->type = RESP_ERROR;
+      snprintf(
+        resp->data.error.message, MAX_ERROR_MESSAGE,
+        "Command %d: %.100s", i + 1, result.data.error.message
+      );
+
+      return;
     }
   }
 
-  printf("\nShutting down...\n");
-
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (client_fds[i] != -1) {
-      close(client_fds[i]);
+  for (int i = 0; i < batch->count; i++) {
+    if (batch->commands[i].type == CMD_SETUP) {
+      gpio_set_output(batch->commands[i].data.setup.gpio);
     }
   }
 
-  if (listen_fd >= 0) {
-    close(listen_fd);
-    unlink(SOCKET_PATH);
+  if (batch->count > 0) {
+    controller = scratch;
+    pwm_publish(&controller);
   }
 
+  resp->type = RESP_OK;
+}
+
+/**
+ * Start or stop the frame tick that drives notifications
+ *
+ * No-op without a timer, replays notify after every frame instead.
+ */
+static void arm_tick(bool armed) {
+  if (tick_fd < 0 || armed == tick_armed) {
+    return;
+  }
+
+  struct itimerspec spec = {0};
+  if (armed) {
+    spec.it_interval.tv_nsec = PWM_FRAME_US * NS_PER_US;
+    spec.it_value = spec.it_interval;
+  }
+
+  if (timerfd_settime(tick_fd, 0, &spec, NULL) < 0) {
+    perror("Failed setting watch timer");
+    return;
+  }
+
+  tick_armed = armed;
+}
+
+/**
+ * WATCH and UNWATCH, subscriptions belong to the connection
+ */
+static void update_watch(Client *client, const Command *cmd, Response *resp) {
+  uint64_t channels = ~0ULL;
+
+  if (!cmd->data.watch.all) {
+    if (cmd->channel >= MAX_SERVO_CHANNELS) {
+      resp->type = RESP_ERROR;
+      snprintf(resp->data.error.message, MAX_ERROR_MESSAGE, "Invalid channel");
+
+      return;
+    }
+
+    channels = 1ULL << cmd->channel;
+  }
+
+  if (cmd->type == CMD_UNWATCH) {
+    if (client->watch) {
+      watch_remove(client->watch, channels);
+    }
+
+    resp->type = RESP_OK;
+    return;
+  }
+
+  if (cmd->data.watch.rate_hz > WATCH_MAX_RATE_HZ) {
+    resp->type = RESP_ERROR;
+    snprintf(
+      resp->data.error.message, MAX_ERROR_MESSAGE,
+      "Invalid rate: outside 1-%d Hz", WATCH_MAX_RATE_HZ
+    );
+
+    return;
+  }
+
+  if (!client->watch) {
+    client->watch = calloc(1, sizeof(Watch));
+    if (!client->watch) {
+      resp->type = RESP_ERROR;
+      snprintf(resp->data.error.message, MAX_ERROR_MESSAGE, "Out of memory");
+
+      return;
+    }
+  }
+
+  watch_add(client->watch, channels, cmd->data.watch.rate_hz);
+  arm_tick(true);
+  resp->type = RESP_OK;
+}
+
+/**
+ * What subscribers see of every channel, including pulses driven by the
+ * PWM thread
+ */
+static void snapshot_channels(WatchState *states) {
+  for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    const ServoChannel *ch = &controller.channels[i];
+
+    states[i] = (WatchState) {
+      .pulse_us = pwm_current_pulse(&controller, i),
+      .min_us = ch->min_us,
+      .max_us = ch->max_us,
+      .enabled = ch->enabled
+    };
+  }
+}
+
+static void notify_client(Client *client, const WatchState *states, uint64_t now_ns) {
+  char buffer[WATCH_OUTPUT_SIZE];
+
+  // A client that does not keep up is throttled, what changed meanwhile
+  // stays pending and goes out coalesced once it caught up
+  if (output_space(client) < sizeof(buffer)) {
+    return;
+  }
+
+  size_t length = watch_collect(client->watch, states, now_ns, buffer, sizeof(buffer));
+  if (length > 0) {
+    client_send(client, buffer, length);
+  }
+}
+
+/**
+ * Frame tick: send every subscriber what changed
+ */
+static void notify_watchers(void) {
+  uint64_t expirations;
+  WatchState states[MAX_SERVO_CHANNELS];
+
+  if (read(tick_fd, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+
+  snapshot_channels(states);
+  uint64_t now_ns = timebase_now_ns();
+
+  for (size_t i = 0; i < num_clients; i++) {
+    if (clients[i]->watch && clients[i]->watch->channels) {
+      notify_client(clients[i], states, now_ns);
+    }
+  }
+}
+
+/**
+ * GET CLIENTS: a CLIENTS <n> line followed by one line per connection
+ *
+ * Lists as many connections as the output has room for, n says how many.
+ */
+static void report_clients(Client *client) {
+  char line[CLIENT_REPORT_LENGTH];
+  size_t count = (output_space(client) - CLIENT_REPORT_LENGTH) / CLIENT_REPORT_LENGTH;
+
+  if (count > num_clients) {
+    count = num_clients;
+  }
+
+  int len = snprintf(line, sizeof(line), "CLIENTS %zu\n", count);
+  client_send(client, line, len);
+
+  for (size_t i = 0; i < count; i++) {
+    const Client *other = clients[i];
+    const ClientCounters *counters = &other->counters;
+
+    len = snprintf(
+      line, sizeof(line),
+      "CLIENT %u COMMANDS %llu THROTTLED %llu DEFERRED %llu "
+      "IN %llu OUT %llu QUEUED %zu\n",
+      other->id,
+      (unsigned long long) counters->commands,
+      (unsigned long long) counters->throttled,
+      (unsigned long long) counters->deferred,
+      (unsigned long long) counters->bytes_in,
+      (unsigned long long) counters->bytes_out,
+      output_pending(other)
+    );
+    client_send(client, line, len);
+  }
+}
+
+/**
+ * GET OVERRUNS: an OVERRUNS <n> TOTAL <total> line followed by the n most
+ * recent overruns, oldest first
+ */
+static void report_overruns(Client *client) {
+  StatsOverrun overruns[STATS_OVERRUN_HISTORY];
+  uint64_t total;
+  size_t count = stats_overruns(overruns, &total);
+  size_t room = (output_space(client) - OVERRUN_REPORT_LENGTH) / OVERRUN_REPORT_LENGTH;
+  size_t first = count > room ? count - room : 0;
+
+  char line[OVERRUN_REPORT_LENGTH];
+  int len = snprintf(
+    line, sizeof(line), "OVERRUNS %zu TOTAL %llu\n",
+    count - first, (unsigned long long) total
+  );
+  client_send(client, line, len);
+
+  for (size_t i = first; i < count; i++) {
+    const StatsOverrun *overrun = &overruns[i];
+
+    len = snprintf(
+      line, sizeof(line),
+      "OVERRUN FRAME %llu SHARD %u LATE %u DURATION %u MISSED %u CAUSE %s\n",
+      (unsigned long long) overrun->frame, overrun->shard, overrun->late_us,
+      overrun->duration_us, overrun->missed, stats_cause_name(overrun->cause)
+    );
+    client_send(client, line, len);
+  }
+}
+
+/**
+ * Run one text command and answer it
+ */
+static void handle_command(Client *client, const char *buffer) {
+  Command cmd;
+  Response resp;
+  char resp_buffer[MAX_RESPONSE_LENGTH];
+
+  bool parsed = parse_command(buffer, &cmd);
+
+  if (
+    client->batch &&
+    !(parsed && (cmd.type == CMD_COMMIT || cmd.type == CMD_ABORT))
+  ) {
+    // Rejections within a batch show up on its COMMIT
+    metrics_count_command(parsed ? cmd.type : CMD_INVALID, false);
+    stage_command(client->batch, parsed ? &cmd : NULL);
+    return;
+  }
+
+  // Answered with several lines rather than one response
+  if (parsed && cmd.type == CMD_GET_CLIENTS) {
+    metrics_count_command(cmd.type, false);
+    report_clients(client);
+    return;
+  }
+
+  if (parsed && cmd.type == CMD_GET_OVERRUNS) {
+    metrics_count_command(cmd.type, false);
+    report_overruns(client);
+    return;
+  }
+
+  if (!parsed) {
+    resp.type = RESP_ERROR;
+    snprintf(resp.data.error.message, MAX_ERROR_MESSAGE, "Invalid command");
+  } else {
+    switch (cmd.type) {
+      case CMD_BEGIN: {
+        client->batch = calloc(1, sizeof(Batch));
+        if (!client->batch) {
+          resp.type = RESP_ERROR;
+          snprintf(resp.data.error.message, MAX_ERROR_MESSAGE, "Out of memory");
+
+          break;
+        }
+
+        resp.type = RESP_OK;
+      } break;
+
+      case CMD_COMMIT:
+      case CMD_ABORT: {
+        if (!client->batch) {
+          resp.type = RESP_ERROR;
+          snprintf(resp.data.error.message, MAX_ERROR_MESSAGE, "No batch in progress");
+
+          break;
+        }
+
+        if (cmd.type == CMD_COMMIT) {
+          commit_batch(client->batch, &resp);
+        } else {
+          resp.type = RESP_OK;
+        }
+
+        free(client->batch);
+        client->batch = NULL;
+      } break;
+
+      case CMD_WATCH:
+      case CMD_UNWATCH: {
+        update_watch(client, &cmd, &resp);
+      } break;
+
+      // The connection switches after the OK, text notifications would
+      // break the binary framing
+      case CMD_BINARY: {
+        free(client->watch);
+        client->watch = NULL;
+        client->binary = true;
+        resp.type = RESP_OK;
+      } break;
+
+      default: {
+        apply_command(&cmd, &resp);
+      } break;
+    }
+  }
+
+  metrics_count_command(parsed ? cmd.type : CMD_INVALID, resp.type == RESP_ERROR);
+
+  format_response(&resp, resp_buffer, sizeof(resp_buffer));
+  client_send(client, resp_buffer, strlen(resp_buffer));
+}
+
+/**
+ * Run one complete binary message and answer it
+ */
+static void handle_binary_command(Client *client, const uint8_t *message) {
+  Command cmd;
+  Response resp;
+  uint8_t resp_buffer[BINARY_MESSAGE_SIZE];
+
+  bool parsed = parse_binary_command(message, &cmd);
+
+  if (parsed) {
+    apply_command(&cmd, &resp);
+  } else {
+    resp.type = RESP_ERROR;
+  }
+
+  metrics_count_command(parsed ? cmd.type : CMD_INVALID, resp.type == RESP_ERROR);
+
+  int len = format_binary_response(&cmd, &resp, resp_buffer, sizeof(resp_buffer));
+  if (len > 0) {
+    client_send(client, resp_buffer, len);
+  }
+}
+
+typedef enum {
+  INPUT_INCOMPLETE,
+  INPUT_READY,
+  INPUT_TOO_LONG,
+  INPUT_INVALID
+} InputState;
+
+typedef enum {
+  SERVICE_IDLE,  // No complete command
+  SERVICE_RAN,
+  SERVICE_HELD   // A command has to wait
+} ServiceResult;
+
+/**
+ * Find the command at the front of the client's input
+ *
+ * @param size Set to the command's size, newline included, when ready
+ */
+static InputState next_input(const Client *client, size_t *size) {
+  const char *start = client->buffer + client->buffer_start;
+  size_t available = client->buffer_len - client->buffer_start;
+
+  if (available == 0) {
+    return INPUT_INCOMPLETE;
+  }
+
+  if (client->binary) {
+    *size = binary_message_size((uint8_t) start[0]);
+    if (*size == 0) {
+      // Framing is lost, there is no way to find the next message
+      return INPUT_INVALID;
+    }
+
+    return available >= *size ? INPUT_READY : INPUT_INCOMPLETE;
+  }
+
+  const char *newline = memchr(start, '\n', available);
+  if (newline) {
+    *size = newline - start + 1;
+    return INPUT_READY;
+  }
+
+  // A text line that does not fit can never complete
+  if (client->buffer_start == 0 && client->buffer_len == sizeof(client->buffer)) {
+    return INPUT_TOO_LONG;
+  }
+
+  return INPUT_INCOMPLETE;
+}
+
+/**
+ * Take one command's worth from the client's token bucket
+ */
+static bool take_token(Client *client, uint64_t now_ns) {
+  uint64_t cost_ns = NS_PER_SEC / client_rate;
+  uint64_t capacity_ns = cost_ns * client_burst;
+
+  client->credit_ns += now_ns - client->refill_ns;
+  client->refill_ns = now_ns;
+  if (client->credit_ns > capacity_ns) {
+    client->credit_ns = capacity_ns;
+  }
+
+  if (client->credit_ns < cost_ns) {
+    return false;
+  }
+
+  client->credit_ns -= cost_ns;
+  return true;
+}
+
+/**
+ * Run the command at the front of the client's input, unless its output,
+ * its rate limit or the frame's budget make it wait
+ */
+static ServiceResult service_client(Client *client, uint64_t now_ns) {
+  size_t size = 0;
+
+  switch (next_input(client, &size)) {
+    case INPUT_INCOMPLETE: {
+      return SERVICE_IDLE;
+    }
+
+    case INPUT_INVALID: {
+      log_push(LOG_CLIENT_INVALID, client->id, 0);
+      client->closing = true;
+      return SERVICE_IDLE;
+    }
+
+    case INPUT_TOO_LONG:
+    case INPUT_READY: {
+    } break;
+  }
+
+  // Waits for the client itself to read its responses
+  if (output_space(client) < MAX_RESPONSE_LENGTH) {
+    return SERVICE_HELD;
+  }
+
+  if (size == 0) {
+    static const char too_long[] = "ERROR Command too long\n";
+    client_send(client, too_long, sizeof(too_long) - 1);
+    client->buffer_start = 0;
+    client->buffer_len = 0;
+
+    return SERVICE_IDLE;
+  }
+
+  if (cmd_budget && budget_left == 0) {
+    if (!client->deferred) {
+      client->counters.deferred++;
+      client->deferred = true;
+    }
+
+    return SERVICE_HELD;
+  }
+
+  if (client_rate && !take_token(client, now_ns)) {
+    if (!client->throttled) {
+      client->counters.throttled++;
+      client->throttled = true;
+    }
+
+    return SERVICE_HELD;
+  }
+
+  char *start = client->buffer + client->buffer_start;
+  client->buffer_start += size;
+
+  if (client->binary) {
+    handle_binary_command(client, (const uint8_t *) start);
+  } else {
+    start[size - 1] = '\0';
+    handle_command(client, start);
+  }
+
+  if (client->buffer_start == client->buffer_len) {
+    client->buffer_start = 0;
+    client->buffer_len = 0;
+  }
+
+  if (budget_left > 0) {
+    budget_left--;
+  }
+
+  client->counters.commands++;
+  client->throttled = false;
+  client->deferred = false;
+
+  return SERVICE_RAN;
+}
+
+/**
+ * Run buffered commands round-robin, one per client and round, so a
+ * client with a long burst cannot delay everyone else's commands
+ *
+ * Clients with commands left stop reading until those ran. Commands held
+ * back by the fairness limits are retried on the next frame tick.
+ */
+static void service_clients(void) {
+  uint64_t now_ns = timebase_now_ns();
+  uint64_t frame = now_ns / (PWM_FRAME_US * NS_PER_US);
+  bool held = false;
+  bool watched = false;
+
+  if (frame != budget_frame) {
+    budget_frame = frame;
+    budget_left = cmd_budget;
+  }
+
+  size_t first = num_clients ? next_serviced++ % num_clients : 0;
+
+  for (bool progress = true; progress;) {
+    progress = false;
+
+    for (size_t i = 0; i < num_clients; i++) {
+      Client *client = clients[(first + i) % num_clients];
+
+      if (!client->closing && service_client(client, now_ns) == SERVICE_RAN) {
+        progress = true;
+      }
+    }
+  }
+
+  // Removing swaps in a client from behind, which was already handled
+  for (size_t i = num_clients; i-- > 0;) {
+    Client *client = clients[i];
+    size_t size;
+
+    if (client->closing) {
+      remove_client(client);
+      continue;
+    }
+
+    InputState input = next_input(client, &size);
+    client->paused = input == INPUT_READY || input == INPUT_TOO_LONG;
+    held |= client->throttled || client->deferred;
+    watched |= client->watch && client->watch->channels;
+    update_client_events(client);
+  }
+
+  arm_tick(held || watched);
+}
+
+static void handle_client_data(Client *client) {
+  // Make room behind any partial command
+  if (client->buffer_start > 0) {
+    client->buffer_len -= client->buffer_start;
+    memmove(client->buffer, client->buffer + client->buffer_start, client->buffer_len);
+    client->buffer_start = 0;
+  }
+
+  // A full buffer waits for its command to run, a zero length read would
+  // look like the client hung up
+  if (client->buffer_len == sizeof(client->buffer)) {
+    return;
+  }
+
+  // Read straight into the client's buffer behind any partial command
+  ssize_t bytes_read = read(
+    client->fd, client->buffer + client->buffer_len,
+    sizeof(client->buffer) - client->buffer_len
+  );
+
+  if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+
+  // Client disconnected or error
+  if (bytes_read <= 0) {
+    client->closing = true;
+    return;
+  }
+
+  client->buffer_len += bytes_read;
+  client->counters.bytes_in += bytes_read;
+  metrics_add_bytes_in(bytes_read);
+}
+
+/**
+ * Compare recorded pulse widths with the commanded ones (simulated GPIO)
+ */
+static void report_pulses(void) {
+  bool header = false;
+
+  for (int i = 0; i < controller.num_channels; i++) {
+    ServoChannel *ch = &controller.channels[i];
+    GpioSimPulses pulses;
+
+    if (ch->gpio == 0 || !gpio_sim_pulse_stats(ch->gpio, &pulses)) {
+      continue;
+    }
+
+    int16_t commanded = pwm_current_pulse(&controller, i);
+
+    if (!header) {
+      printf("Measured pulse widths (us):\n");
+      header = true;
+    }
+
+    printf(
+      "  channel %d gpio %u: commanded %d, pulses %u, mean %.1f, "
+      "min %.1f, max %.1f, error %+.1f\n",
+      i, ch->gpio, commanded, pulses.pulses,
+      pulses.mean_us, pulses.min_us, pulses.max_us,
+      pulses.mean_us - commanded
+    );
+  }
+}
+
+/**
+ * Lock and prefault memory as configured before the PWM thread starts,
+ * failures are reported but not fatal
+ */
+static void setup_memory(void) {
+  if (lock_memory) {
+    if (rt_lock_memory()) {
+      printf("Memory locked (mlockall)\n");
+    } else {
+      fprintf(stderr, "Warning: Could not lock memory: %s\n", strerror(errno));
+    }
+  }
+
+  if (prefault_heap > 0) {
+    if (rt_prefault_heap(prefault_heap)) {
+      printf("Heap prefaulted (%zu KB)\n", prefault_heap / 1024);
+    } else {
+      fprintf(stderr, "Warning: Could not prefault heap: %s\n", strerror(errno));
+    }
+  }
+}
+
+/**
+ * Release all channels and hardware, pins end up as inputs
+ */
+static void release_outputs(void) {
+  report_pulses();
+
   for (int i = 0; i < controller.num_channels; i++) {
     servo_close(&controller.channels[i]);
   }
 
   pwm_cleanup();
   gpio_cleanup();
+}
+
+/**
+ * Replay a command script against the virtual clock
+ *
+ * Commands go through handle_command() with responses on stdout. Lines
+ * starting with '.' drive the simulation:
+ *   .frames <n>  run n PWM frames
+ *   .stall <us>  advance the clock without running frames (late wakeup)
+ * Empty lines and lines starting with '#' are skipped.
+ *
+ * @return 0 on success, 1 if the script could not be read or is invalid
+ */
+static int run_replay(const char *path) {
+  FILE *script = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!script) {
+    perror("Failed to open replay script");
+    return 1;
+  }
+
+  static Client replay_client = {.fd = STDOUT_FILENO};
+  char line[MAX_COMMAND_LENGTH];
+  unsigned line_number = 0;
+  uint64_t frames = 0;
+  uint64_t wall_start = 0;
+  int result = 0;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  wall_start = (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+
+  pwm_arm();
+
+  while (fgets(line, sizeof(line), script)) {
+    line_number++;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+
+    unsigned long value;
+
+    if (sscanf(line, ".frames %lu", &value) == 1) {
+      for (unsigned long i = 0; i < value; i++) {
+        pwm_run_frame();
+
+        if (replay_client.watch && replay_client.watch->channels) {
+          WatchState states[MAX_SERVO_CHANNELS];
+
+          snapshot_channels(states);
+          notify_client(&replay_client, states, timebase_now_ns());
+        }
+      }
+
+      frames += value;
+      continue;
+    }
+
+    if (sscanf(line, ".stall %lu", &value) == 1) {
+      timebase_advance(value * NS_PER_US);
+      continue;
+    }
+
+    if (line[0] == '.') {
+      fprintf(stderr, "%s:%u: unknown directive '%s'\n", path, line_number, line);
+      result = 1;
+      break;
+    }
+
+    printf("> %s\n", line);
+    fflush(stdout);
+    handle_command(&replay_client, line);
+  }
+
+  if (script != stdin) {
+    fclose(script);
+  }
+
+  free(replay_client.batch);
+  free(replay_client.watch);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t wall_ns = (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec - wall_start;
+  double simulated_s = frames * (PWM_FRAME_US / 1e6);
+
+  fprintf(
+    stderr,
+    "Replayed %llu frames (%.1f s) in %.3f s, %.0fx real time\n",
+    (unsigned long long) frames, simulated_s, wall_ns / 1e9,
+    wall_ns > 0 ? simulated_s / (wall_ns / 1e9) : 0.0
+  );
+
+  return result;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options]\n", prog);
+  printf("  -g, --gpio <backend>  GPIO backend: auto (default), gpiomem,\n");
+  printf("                        cdev[:/dev/gpiochipN] or sim[:file.vcd]\n");
+  printf("  -s, --socket <path>   Control socket (default %s)\n", SOCKET_PATH);
+  printf("  -S, --no-spin         Do not busy-wait before edges (saves CPU, adds jitter)\n");
+  printf("  -m, --shm <name>      Accept pulses through a POSIX shared memory segment,\n");
+  printf("                        e.g. %s\n", SHM_NAME);
+  printf("  -M, --metrics <path|port>\n");
+  printf("                        Serve Prometheus metrics on a Unix socket, or on\n");
+  printf("                        a TCP port of 127.0.0.1\n");
+  printf("  -l, --log <target>    Where runtime messages go: stderr (default), syslog\n");
+  printf("                        or a file to append to\n");
+  printf("  -O, --overrun <policy> What a frame that starts late does: catchup\n");
+  printf("                        (default) runs it at once, realign waits for the\n");
+  printf("                        next boundary, skip also drops all outputs low\n");
+  printf("  -b, --cmd-budget <n>  Commands run per 20ms frame over all clients\n");
+  printf("                        (default 0, unlimited)\n");
+  printf("  -R, --client-rate <n> Commands per second per client (default 0, unlimited)\n");
+  printf("  -B, --client-burst <n>\n");
+  printf("                        Commands a client may send at once above its rate\n");
+  printf("                        (default %d)\n", CLIENT_DEFAULT_BURST);
+  printf("  -n, --shards <n>      PWM threads to split the channels over, 1-%d\n", PWM_MAX_SHARDS);
+  printf("                        (default 1)\n");
+  printf("  -C, --cpu <n>         Pin the PWM thread to CPU n, e.g. one set aside\n");
+  printf("                        with isolcpus, further shards go on n+1 and up\n");
+  printf("  -p, --priority <n>    SCHED_FIFO priority of the PWM threads, 1-99 (default %d)\n", PWM_DEFAULT_PRIORITY);
+  printf("  -L, --mlock           Lock all memory with mlockall()\n");
+  printf("      --prefault-stack <KB>\n");
+  printf("                        Fault in this much PWM thread stack at startup\n");
+  printf("      --prefault-heap <KB>\n");
+  printf("                        Fault in and keep this much heap at startup\n");
+  printf("  -c, --config <file>   Read options from key = value lines, keys are the\n");
+  printf("                        long option names\n");
+  printf("  -r, --replay <file>   Run a command script on a virtual clock and exit,\n");
+  printf("                        uses the sim GPIO backend unless -g is given\n");
+  printf("  -h, --help            Show this help\n");
+}
+
+/**
+ * Parse a decimal option value within [min, max]
+ */
+static bool parse_unsigned(const char *arg, unsigned min, unsigned max, unsigned *out) {
+  char *end;
+
+  errno = 0;
+  unsigned long value = strtoul(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || arg[0] == '-' || value < min || value > max) {
+    return false;
+  }
+
+  *out = value;
+  return true;
+}
+
+// Options without a short form
+enum {
+  OPT_PREFAULT_STACK = 256,
+  OPT_PREFAULT_HEAP
+};
+
+static const struct option long_options[] = {
+  {"gpio",           required_argument, NULL, 'g'},
+  {"socket",         required_argument, NULL, 's'},
+  {"no-spin",        no_argument, NULL, 'S'},
+  {"replay",         required_argument, NULL, 'r'},
+  {"shm",            required_argument, NULL, 'm'},
+  {"metrics",        required_argument, NULL, 'M'},
+  {"log",            required_argument, NULL, 'l'},
+  {"overrun",        required_argument, NULL, 'O'},
+  {"cmd-budget",     required_argument, NULL, 'b'},
+  {"client-rate",    required_argument, NULL, 'R'},
+  {"client-burst",   required_argument, NULL, 'B'},
+  {"config",         required_argument, NULL, 'c'},
+  {"shards",         required_argument, NULL, 'n'},
+  {"cpu",            required_argument, NULL, 'C'},
+  {"priority",       required_argument, NULL, 'p'},
+  {"mlock",          no_argument, NULL, 'L'},
+  {"prefault-stack", required_argument, NULL, OPT_PREFAULT_STACK},
+  {"prefault-heap",  required_argument, NULL, OPT_PREFAULT_HEAP},
+  {"help",           no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static bool load_config(const char *path);
+
+/**
+ * Apply one option, from the command line or the config file
+ */
+static bool apply_option(int opt, const char *arg) {
+  unsigned value;
+
+  switch (opt) {
+    case 'g': {
+      if (!gpio_select_backend(arg)) {
+        fprintf(stderr, "Unknown GPIO backend: %s\n", arg);
+        return false;
+      }
+    } break;
+
+    case 's': {
+      socket_path = arg;
+    } break;
+
+    case 'S': {
+      pwm_set_spin(false);
+    } break;
+
+    case 'm': {
+      shm_name = arg;
+    } break;
+
+    case 'M': {
+      metrics_target = arg;
+    } break;
+
+    case 'l': {
+      log_target = arg;
+    } break;
+
+    case 'O': {
+      if (strcmp(arg, "catchup") == 0) {
+        pwm_set_overrun_policy(PWM_OVERRUN_CATCHUP);
+      } else if (strcmp(arg, "realign") == 0) {
+        pwm_set_overrun_policy(PWM_OVERRUN_REALIGN);
+      } else if (strcmp(arg, "skip") == 0) {
+        pwm_set_overrun_policy(PWM_OVERRUN_SKIP);
+      } else {
+        fprintf(stderr, "Unknown overrun policy, expected catchup, realign or skip: %s\n", arg);
+        return false;
+      }
+    } break;
+
+    case 'b': {
+      if (!parse_unsigned(arg, 0, UINT16_MAX, &cmd_budget)) {
+        fprintf(stderr, "Invalid command budget: %s\n", arg);
+        return false;
+      }
+    } break;
+
+    case 'R': {
+      if (!parse_unsigned(arg, 0, 1000000, &client_rate)) {
+        fprintf(stderr, "Invalid client rate: %s\n", arg);
+        return false;
+      }
+    } break;
+
+    case 'B': {
+      if (!parse_unsigned(arg, 1, UINT16_MAX, &client_burst)) {
+        fprintf(stderr, "Invalid client burst: %s\n", arg);
+        return false;
+      }
+    } break;
+
+    case 'c': {
+      return load_config(arg);
+    }
+
+    case 'n': {
+      if (!parse_unsigned(arg, 1, PWM_MAX_SHARDS, &value)) {
+        fprintf(stderr, "Invalid shard count, expected 1-%d: %s\n", PWM_MAX_SHARDS, arg);
+        return false;
+      }
+
+      pwm_set_shards(value);
+    } break;
+
+    case 'C': {
+      if (!parse_unsigned(arg, 0, CPU_SETSIZE - 1, &value)) {
+        fprintf(stderr, "Invalid CPU: %s\n", arg);
+        return false;
+      }
+
+      pwm_set_cpu(value);
+    } break;
+
+    case 'p': {
+      if (!parse_unsigned(arg, 1, 99, &value)) {
+        fprintf(stderr, "Invalid priority, expected 1-99: %s\n", arg);
+        return false;
+      }
+
+      pwm_set_priority(value);
+    } break;
+
+    case 'L': {
+      lock_memory = true;
+    } break;
+
+    case OPT_PREFAULT_STACK: {
+      if (!parse_unsigned(arg, 0, MAX_PREFAULT_STACK_KB, &value)) {
+        fprintf(stderr, "Invalid stack prefault size, expected 0-%d KB: %s\n", MAX_PREFAULT_STACK_KB, arg);
+        return false;
+      }
+
+      pwm_set_prefault_stack((size_t) value * 1024);
+    } break;
+
+    case OPT_PREFAULT_HEAP: {
+      if (!parse_unsigned(arg, 0, MAX_PREFAULT_HEAP_KB, &value)) {
+        fprintf(stderr, "Invalid heap prefault size, expected 0-%d KB: %s\n", MAX_PREFAULT_HEAP_KB, arg);
+        return false;
+      }
+
+      prefault_heap = (size_t) value * 1024;
+    } break;
+
+    case 'r': {
+      replay_path = arg;
+    } break;
+
+    default: {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static char *trim(char *text) {
+  while (*text == ' ' || *text == '\t') {
+    text++;
+  }
+
+  char *end = text + strlen(text);
+  while (end > text && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) {
+    end--;
+  }
+  *end = '\0';
+
+  return text;
+}
+
+/**
+ * Read options from a file of key = value lines
+ *
+ * Keys are the long option names. Options without an argument take yes or
+ * no. Empty lines and lines starting with '#' are skipped.
+ */
+static bool load_config(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open config file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char line[256];
+  unsigned line_number = 0;
+  bool ok = true;
+
+  while (ok && fgets(line, sizeof(line), file)) {
+    line_number++;
+
+    char *key = trim(line);
+    if (key[0] == '\0' || key[0] == '#') {
+      continue;
+    }
+
+    char *separator = strchr(key, '=');
+    if (!separator) {
+      fprintf(stderr, "%s:%u: expected key = value\n", path, line_number);
+      ok = false;
+      break;
+    }
+
+    *separator = '\0';
+    key = trim(key);
+    char *value = trim(separator + 1);
+
+    const struct option *option = long_options;
+    while (option->name && strcmp(option->name, key) != 0) {
+      option++;
+    }
+
+    // Nested config files and help make no sense here
+    if (!option->name || option->val == 'c' || option->val == 'h') {
+      fprintf(stderr, "%s:%u: unknown key '%s'\n", path, line_number, key);
+      ok = false;
+      break;
+    }
+
+    if (option->has_arg == no_argument) {
+      if (strcmp(value, "no") == 0) {
+        continue;
+      }
+
+      if (strcmp(value, "yes") != 0) {
+        fprintf(stderr, "%s:%u: %s takes yes or no\n", path, line_number, key);
+        ok = false;
+        break;
+      }
+
+      ok = apply_option(option->val, NULL);
+    } else {
+      // Options keep pointers to their argument
+      char *copy = strdup(value);
+      ok = copy && apply_option(option->val, copy);
+    }
+
+    if (!ok) {
+      fprintf(stderr, "%s:%u: invalid value for %s\n", path, line_number, key);
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+/**
+ * Command line options are applied in order, so the ones following
+ * --config override the file
+ */
+static bool parse_args(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt_long(argc, argv, "g:s:Sm:M:l:O:b:R:B:c:n:C:p:Lr:h", long_options, NULL)) != -1) {
+    if (opt == 'h') {
+      usage(argv[0]);
+      exit(0);
+    }
+
+    if (opt == '?') {
+      usage(argv[0]);
+      return false;
+    }
+
+    if (!apply_option(opt, optarg)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (!parse_args(argc, argv)) {
+    return 1;
+  }
+
+  // Runtime messages go through the log thread, so the PWM thread never
+  // waits on stdio
+  if (!log_open(log_target)) {
+    return 1;
+  }
+  atexit(log_close);
+
+  printf("Starting servo daemon...\n");
+
+  memset(&controller, 0, sizeof(controller));
+  controller.num_channels = MAX_SERVO_CHANNELS;
+
+  // Replays never touch real hardware by default
+  if (replay_path) {
+    timebase_set_virtual();
+
+    // Frames run one at a time on the main thread
+    if (pwm_num_shards() > 1) {
+      printf("Replays run on a single PWM shard\n");
+      pwm_set_shards(1);
+    }
+
+    if (strcmp(gpio_backend_name(), "auto") == 0) {
+      gpio_select_backend("sim");
+    }
+  }
+
+  if (!gpio_init()) {
+    fprintf(stderr, "Failed to initialize GPIO\n");
+    return 1;
+  }
+
+  printf("Using %s GPIO backend\n", gpio_backend_name());
+
+  if (!pwm_init(&controller)) {
+    fprintf(stderr, "Failed to initialize PWM\n");
+    gpio_cleanup();
+    return 1;
+  }
+
+  if (replay_path) {
+    int result = run_replay(replay_path);
+    release_outputs();
+
+    return result;
+  }
+
+  if (!setup_signals()) {
+    fprintf(stderr, "Failed to setup signal handlers\n");
+    pwm_cleanup();
+    gpio_cleanup();
+    return 1;
+  }
+
+  listen_fd = create_socket();
+  if (listen_fd < 0) {
+    pwm_cleanup();
+    gpio_cleanup();
+    return 1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event listen_ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (
+    epoll_fd < 0 ||
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_ev) < 0
+  ) {
+    perror("Failed setting up epoll");
+    if (epoll_fd >= 0) {
+      close(epoll_fd);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    pwm_cleanup();
+    gpio_cleanup();
+    return 1;
+  }
+
+  tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event timer_ev = {.events = EPOLLIN, .data.ptr = &tick_fd};
+  if (
+    tick_fd < 0 ||
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &timer_ev) < 0
+  ) {
+    perror("Failed setting up watch timer");
+    if (tick_fd >= 0) {
+      close(tick_fd);
+    }
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    pwm_cleanup();
+    gpio_cleanup();
+    return 1;
+  }
+
+  if (shm_name) {
+    if (!shm_create(shm_name)) {
+      close(tick_fd);
+      close(epoll_fd);
+      close(listen_fd);
+      unlink(socket_path);
+      pwm_cleanup();
+      gpio_cleanup();
+      return 1;
+    }
+
+    printf("Shared memory control plane at %s\n", shm_name);
+  }
+
+  if (metrics_target) {
+    if (!metrics_open(metrics_target, epoll_fd)) {
+      shm_destroy();
+      close(tick_fd);
+      close(epoll_fd);
+      close(listen_fd);
+      unlink(socket_path);
+      pwm_cleanup();
+      gpio_cleanup();
+      return 1;
+    }
+
+    printf("Serving metrics on %s\n", metrics_target);
+  }
+
+  if (cmd_budget) {
+    printf("Command budget: %u per frame\n", cmd_budget);
+  }
+
+  if (client_rate) {
+    printf("Client rate limit: %u commands/s, burst %u\n", client_rate, client_burst);
+  }
+
+  setup_memory();
+
+  if (!pwm_start()) {
+    metrics_close();
+    shm_destroy();
+    close(tick_fd);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    pwm_cleanup();
+    gpio_cleanup();
+    return 1;
+  }
+
+  printf("Servo daemon running\n");
+
+  // Frames run on their own thread, so block here until a socket is ready
+  struct epoll_event events[MAX_EVENTS];
+
+  while (running) {
+    int ready = epoll_pwait(epoll_fd, events, MAX_EVENTS, -1, &wait_mask);
+    if (ready < 0) {
+      if (errno != EINTR) {
+        perror("epoll_wait failed");
+        break;
+      }
+
+      continue;
+    }
+
+    // Clients are only marked for removal here, commands run afterwards
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_clients();
+      } else if (events[i].data.ptr == &tick_fd) {
+        notify_watchers();
+      } else if (!metrics_handle_event(events[i].data.ptr, events[i].events)) {
+        Client *client = events[i].data.ptr;
+
+        if ((events[i].events & EPOLLOUT) && !flush_output(client)) {
+          client->closing = true;
+          continue;
+        }
+
+        // Hangups are reported even while input is paused
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          handle_client_data(client);
+        }
+      }
+    }
+
+    service_clients();
+  }
+
+  printf("\nShutting down...\n");
+
+  // Stop driving pins before releasing them
+  pwm_stop();
+
+  while (num_clients > 0) {
+    remove_client(clients[num_clients - 1]);
+  }
+  free(clients);
+  metrics_close();
+  close(tick_fd);
+  close(epoll_fd);
+  shm_destroy();
+
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path);
+  }
+
+  release_outputs();
 
   printf("Shutdown complete\n");
   return 0;
@@ -1,194 +1,559 @@
 #include <string.h>
-#include <ctype.h>
 #include <stdio.h>
-#include <stdlib.h>
 
 #include "protocol.h"
 
-static void str_toupper(char *str) {
-  for (int i = 0; str[i]; i++) {
-    str[i] = toupper((unsigned char)str[i]);
+typedef enum {
+  KW_NONE,
+  KW_SETUP,
+  KW_ENABLE,
+  KW_DISABLE,
+  KW_SET,
+  KW_GET,
+  KW_RESET,
+  KW_GPIO,
+  KW_RANGE,
+  KW_PULSE,
+  KW_STATE,
+  KW_STATS,
+  KW_BINARY,
+  KW_ALL,
+  KW_BEGIN,
+  KW_COMMIT,
+  KW_ABORT,
+  KW_MOVE,
+  KW_TO,
+  KW_VEL,
+  KW_ACC,
+  KW_KEY,
+  KW_AT,
+  KW_PLAY,
+  KW_STOP,
+  KW_RATE,
+  KW_WATCH,
+  KW_UNWATCH,
+  KW_CLIENTS,
+  KW_OVERRUNS,
+  KW_SHARD,
+  KW_AUTO
+} Keyword;
+
+typedef struct {
+  const char *start;
+  size_t len;
+} Token;
+
+/*
+ * Keywords are found with a perfect hash over the first character, the last
+ * character and the length. Masking with 0x1f maps both cases of a letter to
+ * the same value, so tokens are hashed as they are, without a copy.
+ *
+ * A new keyword that collides with an existing one overwrites its table
+ * entry, which -Wextra (-Woverride-init) reports at compile time.
+ */
+#define KEYWORD_TABLE_SIZE 128
+#define KEYWORD_HASH(first, last, len) \
+  ((((first) & 0x1f) + 5 * ((last) & 0x1f) + 12 * (len)) & (KEYWORD_TABLE_SIZE - 1))
+#define KEYWORD(name, first, last) \
+  [KEYWORD_HASH(first, last, sizeof(#name) - 1)] = {#name, sizeof(#name) - 1, KW_##name}
+
+typedef struct {
+  const char *name;
+  size_t len;
+  Keyword keyword;
+} KeywordEntry;
+
+static const KeywordEntry keywords[KEYWORD_TABLE_SIZE] = {
+  KEYWORD(SETUP, 'S', 'P'),
+  KEYWORD(ENABLE, 'E', 'E'),
+  KEYWORD(DISABLE, 'D', 'E'),
+  KEYWORD(SET, 'S', 'T'),
+  KEYWORD(GET, 'G', 'T'),
+  KEYWORD(RESET, 'R', 'T'),
+  KEYWORD(GPIO, 'G', 'O'),
+  KEYWORD(RANGE, 'R', 'E'),
+  KEYWORD(PULSE, 'P', 'E'),
+  KEYWORD(STATE, 'S', 'E'),
+  KEYWORD(STATS, 'S', 'S'),
+  KEYWORD(BINARY, 'B', 'Y'),
+  KEYWORD(ALL, 'A', 'L'),
+  KEYWORD(BEGIN, 'B', 'N'),
+  KEYWORD(COMMIT, 'C', 'T'),
+  KEYWORD(ABORT, 'A', 'T'),
+  KEYWORD(MOVE, 'M', 'E'),
+  KEYWORD(TO, 'T', 'O'),
+  KEYWORD(VEL, 'V', 'L'),
+  KEYWORD(ACC, 'A', 'C'),
+  KEYWORD(KEY, 'K', 'Y'),
+  KEYWORD(AT, 'A', 'T'),
+  KEYWORD(PLAY, 'P', 'Y'),
+  KEYWORD(STOP, 'S', 'P'),
+  KEYWORD(RATE, 'R', 'E'),
+  KEYWORD(WATCH, 'W', 'H'),
+  KEYWORD(UNWATCH, 'U', 'H'),
+  KEYWORD(CLIENTS, 'C', 'S'),
+  KEYWORD(OVERRUNS, 'O', 'S'),
+  KEYWORD(SHARD, 'S', 'D'),
+  KEYWORD(AUTO, 'A', 'O')
+};
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Split the next whitespace separated token off the input
+ *
+ * @return false at the end of the input
+ */
+static bool next_token(const char **pos, Token *tok) {
+  const char *p = *pos;
+
+  while (is_space(*p)) {
+    p++;
+  }
+
+  tok->start = p;
+  while (*p && !is_space(*p)) {
+    p++;
   }
+
+  tok->len = p - tok->start;
+  *pos = p;
+
+  return tok->len > 0;
 }
 
-bool parse_command(const char *buffer, Command *cmd) {
-  if (!buffer || !cmd) {
-    return false;
+static Keyword token_keyword(const Token *tok) {
+  const char *s = tok->start;
+  size_t len = tok->len;
+
+  const KeywordEntry *entry = &keywords[KEYWORD_HASH(s[0], s[len - 1], len)];
+  if (!entry->name || entry->len != len) {
+    return KW_NONE;
+  }
+
+  // Keywords are upper case letters, clearing bit 5 only folds letters onto them
+  for (size_t i = 0; i < len; i++) {
+    if ((s[i] & ~0x20) != entry->name[i]) {
+      return KW_NONE;
+    }
   }
 
-  // Make a working copy and convert to uppercase
-  char work[MAX_COMMAND_LENGTH];
-  strncpy(work, buffer, MAX_COMMAND_LENGTH - 1);
-  work[MAX_COMMAND_LENGTH - 1] = '\0';
+  return entry->keyword;
+}
+
+/**
+ * Parse a decimal token, rejecting signs, garbage and values above max
+ */
+static bool token_uint(const Token *tok, uint32_t max, uint32_t *out) {
+  uint32_t value = 0;
 
-  // Remove trailing newline if present
-  size_t len = strlen(work);
-  if (len > 0 && work[len - 1] == '\n') {
-    work[len - 1] = '\0';
+  for (size_t i = 0; i < tok->len; i++) {
+    uint32_t digit = (uint32_t) (tok->start[i] - '0');
+    if (digit > 9 || value > (max - digit) / 10) {
+      return false;
+    }
+
+    value = value * 10 + digit;
   }
 
-  str_toupper(work);
+  *out = value;
+  return true;
+}
+
+static bool expect_keyword(const char **pos, Keyword keyword) {
+  Token tok;
+  return next_token(pos, &tok) && token_keyword(&tok) == keyword;
+}
+
+static bool expect_uint(const char **pos, uint32_t max, uint32_t *out) {
+  Token tok;
+  return next_token(pos, &tok) && token_uint(&tok, max, out);
+}
 
-  // Tokenize the command
-  char *token = strtok(work, " ");
-  if (!token) {
-    cmd->type = CMD_INVALID;
+static bool expect_channel(const char **pos, Command *cmd) {
+  uint32_t channel;
+  if (!expect_uint(pos, UINT8_MAX, &channel)) {
     return false;
   }
 
-  if (strcmp(token, "SETUP") == 0) {
-    cmd->type = CMD_SETUP;
+  cmd->channel = channel;
+  return true;
+}
 
-    // Expect channel number
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
-    }
-    cmd->channel = atoi(token);
+static bool expect_end(const char **pos) {
+  Token tok;
+  return !next_token(pos, &tok);
+}
 
-    // Expect "GPIO"
-    token = strtok(NULL, " ");
-    if (!token || strcmp(token, "GPIO") != 0) {
-      cmd->type = CMD_INVALID;
-      return false;
-    }
+/**
+ * SET ALL PULSE p0 p1 ... pN, channels past the last value stay unchanged
+ */
+static CommandType parse_set_all(const char **pos, Command *cmd) {
+  Token tok;
+  uint32_t value;
+  int count = 0;
 
-    // Expect GPIO number
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
+  if (!expect_keyword(pos, KW_PULSE)) {
+    return CMD_INVALID;
+  }
+
+  while (next_token(pos, &tok)) {
+    if (count == MAX_SERVO_CHANNELS || !token_uint(&tok, UINT16_MAX, &value)) {
+      return CMD_INVALID;
     }
-    cmd->data.setup.gpio = atoi(token);
 
-    return true;
+    cmd->data.all.pulses[count++] = value;
   }
 
-  if (strcmp(token, "ENABLE") == 0) {
-    cmd->type = CMD_ENABLE;
+  if (count == 0) {
+    return CMD_INVALID;
+  }
 
-    // Expect channel number
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
-    }
-    cmd->channel = atoi(token);
+  for (int i = count; i < MAX_SERVO_CHANNELS; i++) {
+    cmd->data.all.pulses[i] = PULSE_UNCHANGED;
+  }
 
-    return true;
+  return CMD_SET_ALL_PULSE;
+}
+
+/**
+ * Sub-commands of SET <channel>, or SET ALL
+ */
+static CommandType parse_set(const char **pos, Command *cmd) {
+  Token tok;
+  uint32_t min, max, value, channel;
+
+  if (!next_token(pos, &tok)) {
+    return CMD_INVALID;
   }
 
-  if (strcmp(token, "DISABLE") == 0) {
-    cmd->type = CMD_DISABLE;
+  if (token_keyword(&tok) == KW_ALL) {
+    return parse_set_all(pos, cmd);
+  }
 
-    // Expect channel number
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
+  if (!token_uint(&tok, UINT8_MAX, &channel) || !next_token(pos, &tok)) {
+    return CMD_INVALID;
+  }
+
+  cmd->channel = channel;
+
+  switch (token_keyword(&tok)) {
+    case KW_RANGE: {
+      if (
+        !expect_uint(pos, UINT16_MAX, &min) ||
+        !expect_uint(pos, UINT16_MAX, &max)
+      ) {
+        return CMD_INVALID;
+      }
+
+      cmd->data.range.min = min;
+      cmd->data.range.max = max;
+      return CMD_SET_RANGE;
     }
-    cmd->channel = atoi(token);
 
-    return true;
-  }
+    case KW_PULSE: {
+      if (!expect_uint(pos, UINT16_MAX, &value)) {
+        return CMD_INVALID;
+      }
 
-  if (strcmp(token, "SET") == 0) {
-    // Expect channel number
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
+      cmd->data.pulse.value = value;
+      return CMD_SET_PULSE;
     }
-    cmd->channel = atoi(token);
 
-    // Expect sub-command
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
+    case KW_RATE: {
+      if (!expect_uint(pos, UINT16_MAX, &value)) {
+        return CMD_INVALID;
+      }
+
+      cmd->data.rate.hz = value;
+      return CMD_SET_RATE;
     }
 
-    if (strcmp(token, "RANGE") == 0) {
-      cmd->type = CMD_SET_RANGE;
+    case KW_SHARD: {
+      Token arg;
 
-      // Expect min value
-      token = strtok(NULL, " ");
-      if (!token) {
-        cmd->type = CMD_INVALID;
-        return false;
+      if (!next_token(pos, &arg)) {
+        return CMD_INVALID;
       }
-      cmd->data.range.min = atoi(token);
 
-      // Expect max value
-      token = strtok(NULL, " ");
-      if (!token) {
-        cmd->type = CMD_INVALID;
-        return false;
+      if (token_keyword(&arg) == KW_AUTO) {
+        cmd->data.shard.index = SHARD_AUTO;
+      } else if (token_uint(&arg, SHARD_AUTO - 1, &value)) {
+        cmd->data.shard.index = value;
+      } else {
+        return CMD_INVALID;
       }
-      cmd->data.range.max = atoi(token);
 
-      return true;
+      return CMD_SET_SHARD;
     }
 
-    if (strcmp(token, "PULSE") == 0) {
-      cmd->type = CMD_SET_PULSE;
+    default: {
+      return CMD_INVALID;
+    }
+  }
+}
 
-      // Expect value
-      token = strtok(NULL, " ");
-      if (!token) {
-        cmd->type = CMD_INVALID;
-        return false;
-      }
-      cmd->data.pulse.value = atoi(token);
+/**
+ * GET STATS or one of the GET <channel> queries
+ */
+static CommandType parse_get(const char **pos, Command *cmd) {
+  Token tok;
 
-      return true;
-    }
+  if (!next_token(pos, &tok)) {
+    return CMD_INVALID;
+  }
 
-    // Unknown sub-command
-    cmd->type = CMD_INVALID;
-    return false;
+  // Daemon wide queries take no channel
+  if (token_keyword(&tok) == KW_STATS) {
+    return CMD_GET_STATS;
   }
 
-  if (strcmp(token, "GET") == 0) {
-    // Expect channel
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
-    }
-    cmd->channel = atoi(token);
+  if (token_keyword(&tok) == KW_CLIENTS) {
+    return CMD_GET_CLIENTS;
+  }
 
-    // Expect sub-command
-    token = strtok(NULL, " ");
-    if (!token) {
-      cmd->type = CMD_INVALID;
-      return false;
-    }
+  if (token_keyword(&tok) == KW_OVERRUNS) {
+    return CMD_GET_OVERRUNS;
+  }
 
-    if (strcmp(token, "RANGE") == 0) {
-      cmd->type = CMD_GET_RANGE;
-      return true;
-    }
+  uint32_t channel;
+  if (!token_uint(&tok, UINT8_MAX, &channel) || !next_token(pos, &tok)) {
+    return CMD_INVALID;
+  }
 
-    if (strcmp(token, "PULSE") == 0) {
-      cmd->type = CMD_GET_PULSE;
-      return true;
-    }
+  cmd->channel = channel;
 
-    if (strcmp(token, "STATE") == 0) {
-      cmd->type = CMD_GET_STATE;
-      return true;
-    }
+  switch (token_keyword(&tok)) {
+    case KW_RANGE: return CMD_GET_RANGE;
+    case KW_PULSE: return CMD_GET_PULSE;
+    case KW_STATE: return CMD_GET_STATE;
+    case KW_STATS: return CMD_GET_CHANNEL_STATS;
+    case KW_RATE: return CMD_GET_RATE;
+    case KW_SHARD: return CMD_GET_SHARD;
+    default: return CMD_INVALID;
+  }
+}
+
+/**
+ * Channel or ALL of WATCH and UNWATCH
+ */
+static bool expect_watch_channels(const char **pos, Command *cmd) {
+  Token tok;
+  uint32_t channel;
+
+  if (!next_token(pos, &tok)) {
+    return false;
+  }
 
-    // Unknown sub-command
-    cmd->type = CMD_INVALID;
+  if (token_keyword(&tok) == KW_ALL) {
+    cmd->data.watch.all = true;
+    return true;
+  }
+
+  if (!token_uint(&tok, UINT8_MAX, &channel)) {
+    return false;
+  }
+
+  cmd->channel = channel;
+  cmd->data.watch.all = false;
+  return true;
+}
+
+bool parse_command(const char *buffer, Command *cmd) {
+  if (!buffer || !cmd) {
     return false;
   }
 
-  // Unknown command
+  Token tok;
+  CommandType type = CMD_INVALID;
+  uint32_t gpio;
+
   cmd->type = CMD_INVALID;
-  return false;
+  cmd->channel = 0;
+
+  if (!next_token(&buffer, &tok)) {
+    return false;
+  }
+
+  switch (token_keyword(&tok)) {
+    case KW_SETUP: {
+      if (
+        expect_channel(&buffer, cmd) &&
+        expect_keyword(&buffer, KW_GPIO) &&
+        expect_uint(&buffer, UINT8_MAX, &gpio)
+      ) {
+        cmd->data.setup.gpio = gpio;
+        type = CMD_SETUP;
+      }
+    } break;
+
+    case KW_ENABLE: {
+      if (expect_channel(&buffer, cmd)) {
+        type = CMD_ENABLE;
+      }
+    } break;
+
+    case KW_DISABLE: {
+      if (expect_channel(&buffer, cmd)) {
+        type = CMD_DISABLE;
+      }
+    } break;
+
+    case KW_SET: {
+      type = parse_set(&buffer, cmd);
+    } break;
+
+    case KW_GET: {
+      type = parse_get(&buffer, cmd);
+    } break;
+
+    case KW_RESET: {
+      if (expect_keyword(&buffer, KW_STATS)) {
+        type = CMD_RESET_STATS;
+      }
+    } break;
+
+    case KW_BINARY: {
+      type = CMD_BINARY;
+    } break;
+
+    case KW_MOVE: {
+      uint32_t target, vel, acc;
+
+      if (
+        expect_channel(&buffer, cmd) &&
+        expect_keyword(&buffer, KW_TO) &&
+        expect_uint(&buffer, UINT16_MAX, &target) &&
+        expect_keyword(&buffer, KW_VEL) &&
+        expect_uint(&buffer, UINT32_MAX, &vel) &&
+        expect_keyword(&buffer, KW_ACC) &&
+        expect_uint(&buffer, UINT32_MAX, &acc)
+      ) {
+        cmd->data.move.target = target;
+        cmd->data.move.vel = vel;
+        cmd->data.move.acc = acc;
+        type = CMD_MOVE;
+      }
+    } break;
+
+    case KW_KEY: {
+      uint32_t at_ms, pulse;
+
+      if (
+        expect_channel(&buffer, cmd) &&
+        expect_keyword(&buffer, KW_AT) &&
+        expect_uint(&buffer, UINT32_MAX, &at_ms) &&
+        expect_keyword(&buffer, KW_PULSE) &&
+        expect_uint(&buffer, UINT16_MAX, &pulse)
+      ) {
+        cmd->data.keyframe.at_ms = at_ms;
+        cmd->data.keyframe.pulse = pulse;
+        type = CMD_KEYFRAME;
+      }
+    } break;
+
+    case KW_PLAY: {
+      type = CMD_PLAY;
+    } break;
+
+    case KW_STOP: {
+      type = CMD_STOP;
+    } break;
+
+    case KW_WATCH: {
+      uint32_t hz;
+
+      if (!expect_watch_channels(&buffer, cmd)) {
+        break;
+      }
+
+      // Optional RATE <hz>
+      cmd->data.watch.rate_hz = 0;
+      const char *rest = buffer;
+      if (expect_keyword(&buffer, KW_RATE)) {
+        if (!expect_uint(&buffer, UINT16_MAX, &hz) || hz == 0) {
+          break;
+        }
+
+        cmd->data.watch.rate_hz = hz;
+      } else {
+        buffer = rest;
+      }
+
+      type = CMD_WATCH;
+    } break;
+
+    case KW_UNWATCH: {
+      if (expect_watch_channels(&buffer, cmd)) {
+        type = CMD_UNWATCH;
+      }
+    } break;
+
+    case KW_BEGIN: {
+      type = CMD_BEGIN;
+    } break;
+
+    case KW_COMMIT: {
+      type = CMD_COMMIT;
+    } break;
+
+    case KW_ABORT: {
+      type = CMD_ABORT;
+    } break;
+
+    default: {
+    } break;
+  }
+
+  // Trailing tokens make the whole line invalid
+  if (type == CMD_INVALID || !expect_end(&buffer)) {
+    return false;
+  }
+
+  cmd->type = type;
+  return true;
+}
+
+const char *command_name(CommandType type) {
+  static const char *const names[NUM_COMMAND_TYPES] = {
+    [CMD_SETUP] = "setup",
+    [CMD_ENABLE] = "enable",
+    [CMD_DISABLE] = "disable",
+    [CMD_SET_RANGE] = "set_range",
+    [CMD_SET_PULSE] = "set_pulse",
+    [CMD_GET_RANGE] = "get_range",
+    [CMD_GET_PULSE] = "get_pulse",
+    [CMD_GET_STATE] = "get_state",
+    [CMD_GET_STATS] = "get_stats",
+    [CMD_GET_CHANNEL_STATS] = "get_channel_stats",
+    [CMD_RESET_STATS] = "reset_stats",
+    [CMD_BINARY] = "binary",
+    [CMD_SET_ALL_PULSE] = "set_all_pulse",
+    [CMD_BEGIN] = "begin",
+    [CMD_COMMIT] = "commit",
+    [CMD_ABORT] = "abort",
+    [CMD_MOVE] = "move",
+    [CMD_KEYFRAME] = "keyframe",
+    [CMD_PLAY] = "play",
+    [CMD_STOP] = "stop",
+    [CMD_SET_RATE] = "set_rate",
+    [CMD_GET_RATE] = "get_rate",
+    [CMD_WATCH] = "watch",
+    [CMD_UNWATCH] = "unwatch",
+    [CMD_GET_CLIENTS] = "get_clients",
+    [CMD_GET_OVERRUNS] = "get_overruns",
+    [CMD_SET_SHARD] = "set_shard",
+    [CMD_GET_SHARD] = "get_shard",
+    [CMD_INVALID] = "invalid"
+  };
+
+  if ((unsigned) type >= NUM_COMMAND_TYPES || !names[type]) {
+    return "unknown";
+  }
+
+  return names[type];
 }
 
 int format_response(const Response *resp, char *buffer, size_t buffer_size) {
@@ -233,6 +598,45 @@ int format_response(const Response *resp, char *buffer, size_t buffer_size) {
       );
     } break;
 
+    case RESP_STATS: {
+      written = snprintf(
+        buffer, buffer_size,
+        "STATS FRAMES %u OVERRUNS %u WAKEUPS %u LATE %u P50 %u P99 %u MAX %u\n",
+        resp->data.stats.frames,
+        resp->data.stats.overruns,
+        resp->data.stats.wakeups,
+        resp->data.stats.late_wakeups,
+        resp->data.stats.p50_us,
+        resp->data.stats.p99_us,
+        resp->data.stats.max_us
+      );
+    } break;
+
+    case RESP_CHANNEL_STATS: {
+      written = snprintf(
+        buffer, buffer_size,
+        "STATS EDGES %u P50 %u P99 %u MAX %u\n",
+        resp->data.stats.edges,
+        resp->data.stats.p50_us,
+        resp->data.stats.p99_us,
+        resp->data.stats.max_us
+      );
+    } break;
+
+    case RESP_RATE: {
+      written = snprintf(
+        buffer, buffer_size,
+        "RATE %u\n", resp->data.rate.hz
+      );
+    } break;
+
+    case RESP_SHARD: {
+      written = snprintf(
+        buffer, buffer_size,
+        "SHARD %u\n", resp->data.shard.index
+      );
+    } break;
+
     default: {
       return -1;
     }
@@ -244,3 +648,155 @@ int format_response(const Response *resp, char *buffer, size_t buffer_size) {
 
   return written;
 }
+
+static uint16_t read_le16(const uint8_t *p) {
+  return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static void write_le16(uint8_t *p, uint16_t value) {
+  p[0] = value & 0xff;
+  p[1] = value >> 8;
+}
+
+size_t binary_message_size(uint8_t type) {
+  switch (type) {
+    case BIN_SETUP:
+    case BIN_ENABLE:
+    case BIN_DISABLE:
+    case BIN_SET_RANGE:
+    case BIN_SET_PULSE:
+    case BIN_GET_RANGE:
+    case BIN_GET_PULSE:
+    case BIN_GET_STATE:
+      return BINARY_MESSAGE_SIZE;
+
+    case BIN_SET_ALL_PULSE:
+      return BINARY_SET_ALL_SIZE;
+
+    default:
+      return 0;
+  }
+}
+
+bool parse_binary_command(const uint8_t *buffer, Command *cmd) {
+  if (!buffer || !cmd) {
+    return false;
+  }
+
+  uint16_t arg0 = read_le16(buffer + 2);
+  uint16_t arg1 = read_le16(buffer + 4);
+
+  cmd->channel = buffer[1];
+
+  switch (buffer[0]) {
+    case BIN_SETUP: {
+      if (arg0 > UINT8_MAX) {
+        cmd->type = CMD_INVALID;
+        return false;
+      }
+
+      cmd->type = CMD_SETUP;
+      cmd->data.setup.gpio = arg0;
+    } break;
+
+    case BIN_ENABLE: cmd->type = CMD_ENABLE; break;
+    case BIN_DISABLE: cmd->type = CMD_DISABLE; break;
+
+    case BIN_SET_RANGE: {
+      cmd->type = CMD_SET_RANGE;
+      cmd->data.range.min = arg0;
+      cmd->data.range.max = arg1;
+    } break;
+
+    case BIN_SET_PULSE: {
+      cmd->type = CMD_SET_PULSE;
+      cmd->data.pulse.value = arg0;
+    } break;
+
+    case BIN_GET_RANGE: cmd->type = CMD_GET_RANGE; break;
+    case BIN_GET_PULSE: cmd->type = CMD_GET_PULSE; break;
+    case BIN_GET_STATE: cmd->type = CMD_GET_STATE; break;
+
+    case BIN_SET_ALL_PULSE: {
+      cmd->type = CMD_SET_ALL_PULSE;
+      cmd->channel = 0;
+
+      const uint8_t *pulses = buffer + BINARY_MESSAGE_SIZE;
+      for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+        cmd->data.all.pulses[i] = read_le16(pulses + 2 * i);
+      }
+    } break;
+
+    default: {
+      cmd->type = CMD_INVALID;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static uint8_t binary_request_type(CommandType type) {
+  switch (type) {
+    case CMD_SETUP: return BIN_SETUP;
+    case CMD_ENABLE: return BIN_ENABLE;
+    case CMD_DISABLE: return BIN_DISABLE;
+    case CMD_SET_RANGE: return BIN_SET_RANGE;
+    case CMD_SET_PULSE: return BIN_SET_PULSE;
+    case CMD_GET_RANGE: return BIN_GET_RANGE;
+    case CMD_GET_PULSE: return BIN_GET_PULSE;
+    case CMD_GET_STATE: return BIN_GET_STATE;
+    case CMD_SET_ALL_PULSE: return BIN_SET_ALL_PULSE;
+    default: return 0;
+  }
+}
+
+int format_binary_response(
+  const Command *cmd, const Response *resp, uint8_t *buffer, size_t buffer_size
+) {
+  if (!cmd || !resp || !buffer || buffer_size < BINARY_MESSAGE_SIZE) {
+    return -1;
+  }
+
+  uint16_t value0 = 0;
+  uint16_t value1 = 0;
+
+  switch (resp->type) {
+    case RESP_OK: {
+      buffer[0] = BIN_RESP_OK;
+    } break;
+
+    case RESP_ERROR: {
+      buffer[0] = BIN_RESP_ERROR;
+    } break;
+
+    case RESP_RANGE: {
+      buffer[0] = BIN_RESP_RANGE;
+      value0 = resp->data.range.min;
+      value1 = resp->data.range.max;
+    } break;
+
+    case RESP_PULSE: {
+      buffer[0] = BIN_RESP_PULSE;
+      value0 = resp->data.pulse.value;
+    } break;
+
+    case RESP_STATE: {
+      buffer[0] = BIN_RESP_STATE;
+      value0 = resp->data.state.gpio;
+      value1 = resp->data.state.enabled;
+    } break;
+
+    default: {
+      return -1;
+    }
+  }
+
+  buffer[1] = binary_request_type(cmd->type);
+  buffer[2] = cmd->channel;
+  buffer[3] = 0;
+  write_le16(buffer + 4, value0);
+  write_le16(buffer + 6, value1);
+
+  return BINARY_MESSAGE_SIZE;
+}
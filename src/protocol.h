@@ -3,11 +3,56 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
-#define MAX_COMMAND_LENGTH 256
+#include "servo.h"
+
+// Room for SET ALL PULSE with every channel
+#define MAX_COMMAND_LENGTH 512
 #define MAX_RESPONSE_LENGTH 256
 #define MAX_ERROR_MESSAGE 128
 
+// SET ALL PULSE entry that leaves a channel alone
+#define PULSE_UNCHANGED 0xFFFF
+// SET SHARD AUTO, the daemon picks a shard when the channel is enabled
+#define SHARD_AUTO 0xFF
+
+/*
+ * Binary mode, entered with the text command BINARY. Every message has a
+ * fixed size given by its type byte, multi-byte fields are little-endian.
+ *
+ * Requests are 8 bytes:
+ *   u8 type, u8 channel, u16 arg0, u16 arg1, u16 reserved
+ * except BIN_SET_ALL_PULSE, where the 8 byte header (channel ignored) is
+ * followed by one u16 pulse per channel, PULSE_UNCHANGED skips one.
+ *
+ * Responses are 8 bytes:
+ *   u8 response type, u8 request type, u8 channel, u8 reserved,
+ *   u16 value0, u16 value1
+ */
+#define BINARY_MESSAGE_SIZE 8
+#define BINARY_SET_ALL_SIZE (BINARY_MESSAGE_SIZE + 2 * MAX_SERVO_CHANNELS)
+
+typedef enum {
+  BIN_SETUP = 1,          // arg0 gpio
+  BIN_ENABLE = 2,
+  BIN_DISABLE = 3,
+  BIN_SET_RANGE = 4,      // arg0 min, arg1 max
+  BIN_SET_PULSE = 5,      // arg0 pulse
+  BIN_GET_RANGE = 6,
+  BIN_GET_PULSE = 7,
+  BIN_GET_STATE = 8,
+  BIN_SET_ALL_PULSE = 9
+} BinaryRequestType;
+
+typedef enum {
+  BIN_RESP_OK = 0,
+  BIN_RESP_ERROR = 1,
+  BIN_RESP_RANGE = 2,     // value0 min, value1 max
+  BIN_RESP_PULSE = 3,     // value0 pulse
+  BIN_RESP_STATE = 4      // value0 gpio, value1 enabled
+} BinaryResponseType;
+
 typedef enum {
   CMD_SETUP,
   CMD_ENABLE,
@@ -17,15 +62,41 @@ typedef enum {
   CMD_GET_RANGE,
   CMD_GET_PULSE,
   CMD_GET_STATE,
+  CMD_GET_STATS,
+  CMD_GET_CHANNEL_STATS,
+  CMD_RESET_STATS,
+  CMD_BINARY,
+  CMD_SET_ALL_PULSE,
+  CMD_BEGIN,
+  CMD_COMMIT,
+  CMD_ABORT,
+  CMD_MOVE,
+  CMD_KEYFRAME,
+  CMD_PLAY,
+  CMD_STOP,
+  CMD_SET_RATE,
+  CMD_GET_RATE,
+  CMD_WATCH,
+  CMD_UNWATCH,
+  CMD_GET_CLIENTS,
+  CMD_GET_OVERRUNS,
+  CMD_SET_SHARD,
+  CMD_GET_SHARD,
   CMD_INVALID
 } CommandType;
 
+#define NUM_COMMAND_TYPES (CMD_INVALID + 1)
+
 typedef enum {
   RESP_OK,
   RESP_ERROR,
   RESP_RANGE,
   RESP_PULSE,
-  RESP_STATE
+  RESP_STATE,
+  RESP_STATS,
+  RESP_CHANNEL_STATS,
+  RESP_RATE,
+  RESP_SHARD
 } ResponseType;
 
 typedef struct {
@@ -44,6 +115,37 @@ typedef struct {
     struct {
       uint16_t value;
     } pulse;
+
+    struct {
+      uint16_t hz;
+    } rate;
+
+    // SHARD_AUTO to let the daemon pick
+    struct {
+      uint8_t index;
+    } shard;
+
+    // rate_hz 0 keeps the subscriber's rate
+    struct {
+      bool     all;
+      uint16_t rate_hz;
+    } watch;
+
+    struct {
+      uint16_t target;
+      uint32_t vel;
+      uint32_t acc;
+    } move;
+
+    struct {
+      uint32_t at_ms;
+      uint16_t pulse;
+    } keyframe;
+
+    // PULSE_UNCHANGED leaves a channel alone
+    struct {
+      uint16_t pulses[MAX_SERVO_CHANNELS];
+    } all;
   } data;
 } Command;
 
@@ -67,6 +169,25 @@ typedef struct {
       uint8_t gpio;
       bool enabled;
     } state;
+
+    struct {
+      uint16_t hz;
+    } rate;
+
+    struct {
+      uint8_t index;
+    } shard;
+
+    struct {
+      uint32_t frames;
+      uint32_t overruns;
+      uint32_t wakeups;
+      uint32_t late_wakeups;
+      uint32_t edges;
+      uint32_t p50_us;
+      uint32_t p99_us;
+      uint32_t max_us;
+    } stats;
   } data;
 } Response;
 
@@ -80,6 +201,11 @@ typedef struct {
  */
 bool parse_command(const char *buffer, Command *cmd);
 
+/**
+ * Lower case name of a command type, e.g. "set_pulse", for metrics labels
+ */
+const char *command_name(CommandType type);
+
 /**
  * Format a response structure into a string
  *
@@ -91,4 +217,29 @@ bool parse_command(const char *buffer, Command *cmd);
  */
 int format_response(const Response *resp, char *buffer, size_t buffer_size);
 
+/**
+ * Size of a binary message from its first byte
+ *
+ * @return 0 for an unknown type, the stream can not be resynchronized then
+ */
+size_t binary_message_size(uint8_t type);
+
+/**
+ * Decode a complete binary message of binary_message_size() bytes
+ *
+ * @return true on success, false for types without a Command
+ */
+bool parse_binary_command(const uint8_t *buffer, Command *cmd);
+
+/**
+ * Encode the answer to a command as a BINARY_MESSAGE_SIZE message
+ *
+ * Error messages are not sent, only the failing request type and channel.
+ *
+ * @return Number of bytes written, or -1 on error
+ */
+int format_binary_response(
+  const Command *cmd, const Response *resp, uint8_t *buffer, size_t buffer_size
+);
+
 #endif // PROTOCOL_H
@@ -3,67 +3,784 @@
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
-#include <sched.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "pwm.h"
 #include "gpio.h"
+#include "keyframe.h"
+#include "log.h"
+#include "motion.h"
+#include "rt.h"
+#include "shm.h"
+#include "stats.h"
+#include "timebase.h"
 
-static int timer_fd = -1;
+// Give up on a snapshot after this many torn reads and retry next frame
+#define PWM_SNAPSHOT_RETRIES 4
+
+#define PWM_FRAME_NS (PWM_FRAME_US * NS_PER_US)
+
+// Upper bound for the busy-wait before each edge
+#define PWM_SPIN_MAX_US 100
+// Added on top of the measured wakeup latency
+#define PWM_SPIN_MARGIN_US 5
+#define PWM_CALIBRATE_SAMPLES 64
+#define PWM_CALIBRATE_SLEEP_US 500
+
+// A first edge up to this much past its deadline still runs as a normal
+// frame, only later ones fall under the overrun policy
+#define PWM_LATE_TOLERANCE_US 100
+
+// Stack kept on top of the prefaulted part for the frame path itself
+#define PWM_STACK_HEADROOM (256 * 1024)
+
+_Static_assert(SERVO_ABSOLUTE_MAX <= PWM_SLOT_US, "Pulses must fit in a slot");
+_Static_assert(MAX_SERVO_CHANNELS <= 64, "Event channel mask is 64 bits");
+
+typedef struct {
+  ServoChannel channels[MAX_SERVO_CHANNELS];
+  uint8_t      num_channels;
+  unsigned     moved_seq[MAX_SERVO_CHANNELS];  // Table that moved the channel to its shard
+} PwmTable;
+
+/*
+ * One step of the compiled frame: at offset_us into the frame, drop every
+ * pin in clear_mask and then raise every pin in set_mask. channels lists the
+ * channels with an edge in this step, for the lateness statistics.
+ */
+typedef struct {
+  uint32_t offset_us;
+  uint32_t set_mask;
+  uint32_t clear_mask;
+  uint64_t channels;
+} PwmEvent;
+
+// Rising edges of the fastest channel within one frame, rounded up
+#define PWM_MIN_PERIOD_US SERVO_PERIOD_US(SERVO_MAX_RATE_HZ)
+#define PWM_MAX_RISES ((PWM_FRAME_US + PWM_MIN_PERIOD_US - 1) / PWM_MIN_PERIOD_US)
+// One rising and one falling edge per period of every channel
+#define PWM_MAX_EVENTS (MAX_SERVO_CHANNELS * PWM_MAX_RISES * 2)
+
+// Sort keys pack the offset above the event index
+#define PWM_EVENT_INDEX_BITS 11
+
+_Static_assert(PWM_MAX_EVENTS <= (1 << PWM_EVENT_INDEX_BITS), "Event index must fit its key bits");
+_Static_assert(
+  (PWM_FRAME_US + SERVO_ABSOLUTE_MAX) < (1u << (32 - PWM_EVENT_INDEX_BITS)),
+  "Event offset must fit its key bits"
+);
+
+/*
+ * Edges of one frame window. Channels run at their own period on a shared
+ * timeline: next_rise_us is where each channel's next period starts,
+ * relative to the window start. Falling edges that spill past the window
+ * are carried into the next one, with offsets relative to its start.
+ */
+typedef struct {
+  PwmEvent events[PWM_MAX_EVENTS];
+  uint16_t num_events;
+  PwmEvent carry[MAX_SERVO_CHANNELS];
+  uint8_t  num_carry;
+  uint32_t period_us[MAX_SERVO_CHANNELS];     // 0 while a channel is off
+  uint32_t next_rise_us[MAX_SERVO_CHANNELS];
+  uint32_t pin_mask;  // Pins of every running channel
+  bool     periodic;  // Every period divides the frame, windows repeat
+} PwmSchedule;
+
+/*
+ * Channel table shared between the socket thread (writer) and the PWM thread
+ * (reader). Guarded by a seqlock: the sequence is odd while a write is in
+ * progress, so the reader can detect a torn copy without ever blocking.
+ */
+static PwmTable shared_table;
+static atomic_uint shared_seq;
+
+/*
+ * Pulse each channel is driven with, packed as pulse_gen << 32 | pulse_us.
+ * Written by the PWM thread whenever its table changes, so readers can tell
+ * a pulse that came through shared memory from one still in flight.
+ */
+static atomic_uint_least64_t live_pulses[MAX_SERVO_CHANNELS];
+
+/*
+ * One PWM thread and the channels assigned to it. Every shard takes its
+ * own copy of the shared table and only drives, steps and reports the
+ * channels whose shard field names it. Shards run on the same frame grid,
+ * so frame numbers line up between them.
+ */
+typedef struct {
+  uint8_t     index;
+  int         timer_fd;
+  uint64_t    ticks;           // Frames of the grid passed so far
+  bool        armed;
+  uint32_t    spin_us;         // Calibrated busy-wait before each edge
+  int         cpu;             // CPU the thread is pinned to, -1 for any
+  pthread_t   thread;
+  bool        thread_started;
+  uint64_t    last_start_ns;   // Timeline of the previous frame from its wakeup, for overruns
+  uint64_t    last_edges_ns;
+  uint64_t    last_done_ns;
+  unsigned    table_seq;
+  unsigned    carry_seq;       // Table the carried falls were compiled from
+  atomic_uint acked_seq;       // Tables up to this one have fully run here
+  uint64_t    pending;         // Channels moved here, waiting for their old shard
+  PwmTable    table;     // Private copy only touched by the shard's thread
+  uint64_t    channels;  // Channels of the table assigned to this shard
+  PwmSchedule schedule;  // Compiled from table, rebuilt when it changes
+  PwmEvent    carry_in[MAX_SERVO_CHANNELS];  // Falls left over from the last frame
+  uint8_t     num_carry_in;
+  uint64_t    carry_start_ns;  // Where carry_in offsets count from
+  Motion      motion[MAX_SERVO_CHANNELS];
+  KeyframePlayer keyframes;
+} PwmShard;
+
+_Static_assert(PWM_MAX_SHARDS == 4, "Update the shard initializers below");
+
+static struct {
+  uint64_t    first_frame_ns;  // Absolute start of frame 0 of the grid
+  uint8_t     num_shards;
+  bool        spin_enabled;
+  int         priority;        // SCHED_FIFO priority of the PWM threads
+  int         cpu;             // CPU of the first shard, -1 to pick one
+  size_t      prefault_stack;  // Stack bytes faulted in before the first frame
+  PwmOverrunPolicy overrun_policy;
+  atomic_bool running;
+  PwmShard    shards[PWM_MAX_SHARDS];
+} engine = {
+  .num_shards = 1,
+  .spin_enabled = true,
+  .priority = PWM_DEFAULT_PRIORITY,
+  .cpu = -1,
+  .shards = {
+    {.index = 0, .timer_fd = -1, .cpu = -1},
+    {.index = 1, .timer_fd = -1, .cpu = -1},
+    {.index = 2, .timer_fd = -1, .cpu = -1},
+    {.index = 3, .timer_fd = -1, .cpu = -1}
+  }
+};
+
+static struct timespec ns_to_timespec(uint64_t ns) {
+  struct timespec ts = {
+    .tv_sec = ns / NS_PER_SEC,
+    .tv_nsec = ns % NS_PER_SEC
+  };
+
+  return ts;
+}
 
 /**
- * Sleep for a specified number of microseconds using high-resolution timer
+ * Sleep until an absolute deadline on the timebase
+ *
+ * Wakes up spin_us early and busy-waits the rest, so kernel wakeup latency
+ * does not end up in the edge timing. Deadlines are absolute, so errors do
+ * not accumulate along the frame.
  */
-static void sleep_us(uint32_t microseconds) {
-  struct timespec ts;
+static void sleep_until(const PwmShard *shard, uint64_t deadline_ns) {
+  uint64_t spin_ns = shard->spin_us * NS_PER_US;
 
-  ts.tv_sec = microseconds / 1000000;
-  ts.tv_nsec = (microseconds % 1000000) * 1000;
+  if (deadline_ns > spin_ns) {
+    timebase_sleep_until(deadline_ns - spin_ns);
+    stats_record_wakeup(timebase_now_ns() > deadline_ns);
+  }
 
-  clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+  if (spin_ns > 0) {
+    while (timebase_now_ns() < deadline_ns);
+  }
 }
 
 /**
- * Initialize PWM system
+ * Measure how late absolute sleeps wake up on this system
+ *
+ * Runs on the PWM thread after its priority was raised, since that is the
+ * latency the frames will see.
+ *
+ * @return Spin threshold in microseconds
  */
-bool pwm_init(ServoController *controller) {
-  if (!controller) {
-    return false;
+static uint32_t pwm_calibrate_spin(void) {
+  uint32_t late_us[PWM_CALIBRATE_SAMPLES];
+
+  for (int i = 0; i < PWM_CALIBRATE_SAMPLES; i++) {
+    uint64_t target = timebase_now_ns() + PWM_CALIBRATE_SLEEP_US * NS_PER_US;
+    timebase_sleep_until(target);
+
+    uint64_t late = timebase_now_ns() - target;
+    late_us[i] = (late + NS_PER_US - 1) / NS_PER_US;
+  }
+
+  // Insertion sort, the sample count is small
+  for (int i = 1; i < PWM_CALIBRATE_SAMPLES; i++) {
+    uint32_t value = late_us[i];
+    int j = i - 1;
+
+    while (j >= 0 && late_us[j] > value) {
+      late_us[j + 1] = late_us[j];
+      j--;
+    }
+
+    late_us[j + 1] = value;
+  }
+
+  // Cover 95% of wakeups, the spin soaks up the rest
+  uint32_t spin_us = late_us[PWM_CALIBRATE_SAMPLES * 95 / 100] + PWM_SPIN_MARGIN_US;
+
+  return spin_us < PWM_SPIN_MAX_US ? spin_us : PWM_SPIN_MAX_US;
+}
+
+/**
+ * Arm a shard's frame timer with absolute expiries, from the next frame of
+ * the grid it can still make
+ *
+ * The timer fires spin_us ahead of each frame start so the rising edge can
+ * be placed with the same precision as the falling ones.
+ */
+static bool pwm_arm_shard(PwmShard *shard) {
+  uint64_t now = timebase_now_ns() + shard->spin_us * NS_PER_US;
+
+  // Nothing of an earlier timeline carries over, each shard starts clean
+  shard->num_carry_in = 0;
+  shard->last_start_ns = 0;
+  shard->last_edges_ns = 0;
+  shard->last_done_ns = 0;
+
+  shard->ticks = 0;
+  if (now >= engine.first_frame_ns) {
+    shard->ticks = (now - engine.first_frame_ns) / PWM_FRAME_NS + 1;
   }
 
-  // Do not leak timer if init is called twice
-  if (timer_fd >= 0) {
-    close(timer_fd);
+  // The virtual clock is stepped by pwm_wait_tick() instead
+  if (timebase_is_virtual()) {
+    shard->armed = true;
+    return true;
   }
 
-  // Create timer file descriptor
-  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-  if (timer_fd < 0) {
-    fprintf(stderr, "Error: Could not create timerfd: %s\n", strerror(errno));
+  if (shard->timer_fd < 0) {
     return false;
   }
 
-  // Configure for 20ms periodic timer
+  uint64_t start = engine.first_frame_ns + shard->ticks * PWM_FRAME_NS;
   struct itimerspec timer_spec = {
-    .it_interval = {.tv_sec = 0, .tv_nsec = PWM_FRAME_US * 1000},
-    .it_value = {.tv_sec = 0, .tv_nsec = PWM_FRAME_US * 1000}
+    .it_interval = ns_to_timespec(PWM_FRAME_NS),
+    .it_value = ns_to_timespec(start - shard->spin_us * NS_PER_US)
   };
 
-  if (timerfd_settime(timer_fd, 0, &timer_spec, NULL) < 0) {
+  if (timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &timer_spec, NULL) < 0) {
     fprintf(stderr, "Error: Could not set timerfd: %s\n", strerror(errno));
-    close(timer_fd);
-    timer_fd = -1;
+    return false;
+  }
+
+  shard->armed = true;
+  return true;
+}
+
+/**
+ * Start the frame grid one period from now and arm the first shard, for
+ * frames run by hand
+ */
+bool pwm_arm(void) {
+  engine.first_frame_ns = timebase_now_ns() + PWM_FRAME_NS;
+  return pwm_arm_shard(&engine.shards[0]);
+}
+
+/**
+ * Block until the next frame is due
+ *
+ * @param expirations Frame periods elapsed since the last call, more than
+ *                    one means frames were missed
+ *
+ * @return false if the timer could not be read
+ */
+static bool pwm_wait_tick(PwmShard *shard, uint64_t *expirations) {
+  if (timebase_is_virtual()) {
+    uint64_t due = engine.first_frame_ns + shard->ticks * PWM_FRAME_NS;
+    uint64_t now = timebase_now_ns();
+
+    if (now < due) {
+      timebase_sleep_until(due);
+      *expirations = 1;
+    } else {
+      *expirations = (now - due) / PWM_FRAME_NS + 1;
+    }
+
+    return true;
+  }
 
+  ssize_t bytes_read = read(shard->timer_fd, expirations, sizeof(*expirations));
+
+  if (bytes_read < 0) {
+    log_push(LOG_TIMER_FAILED, errno, 0);
     return false;
   }
 
-  // Try to set real-time priority for better timing accuracy
-  struct sched_param sp;
-  sp.sched_priority = 99;
+  return true;
+}
+
+/**
+ * Sort events by offset and merge events sharing an offset, so each
+ * distinct edge costs one register write
+ *
+ * Sorts packed offset/index keys rather than whole events. Edges are
+ * generated channel by channel with increasing offsets, so the input is
+ * mostly sorted and an insertion sort beats qsort() here.
+ *
+ * @return New number of events
+ */
+static uint16_t pwm_sort_events(PwmEvent *events, uint16_t count) {
+  static uint32_t keys[PWM_MAX_EVENTS];
+  static PwmEvent sorted[PWM_MAX_EVENTS];
+
+  for (uint16_t i = 0; i < count; i++) {
+    uint32_t key = events[i].offset_us << PWM_EVENT_INDEX_BITS | i;
+    uint16_t j = i;
+
+    while (j > 0 && keys[j - 1] > key) {
+      keys[j] = keys[j - 1];
+      j--;
+    }
+
+    keys[j] = key;
+  }
+
+  uint16_t merged = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    const PwmEvent *event = &events[keys[i] & ((1u << PWM_EVENT_INDEX_BITS) - 1)];
+
+    if (merged > 0 && event->offset_us == sorted[merged - 1].offset_us) {
+      PwmEvent *last = &sorted[merged - 1];
+
+      last->set_mask |= event->set_mask;
+      last->clear_mask |= event->clear_mask;
+      last->channels |= event->channels;
+    } else {
+      sorted[merged++] = *event;
+    }
+  }
+
+  memcpy(events, sorted, merged * sizeof(PwmEvent));
+  return merged;
+}
+
+/**
+ * Compile a channel table into the edges of the next frame window
+ *
+ * Every channel rises once per period, starting from its slot offset so
+ * channels sharing a rate stay staggered, and falls pulse_us later. A
+ * channel that was off, or changed its rate, starts over at that offset.
+ *
+ * When all periods divide the frame, every window looks the same and the
+ * result can be reused until the table changes.
+ *
+ * @param channels Mask of the channels to compile, the others are skipped
+ */
+static void pwm_compile(const PwmTable *table, uint64_t channels, PwmSchedule *schedule) {
+  uint16_t count = 0;
+
+  schedule->num_carry = 0;
+  schedule->pin_mask = 0;
+  schedule->periodic = true;
+
+  for (uint8_t i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    const ServoChannel *ch = &table->channels[i];
+
+    if (
+      i >= table->num_channels || !(channels & (1ULL << i)) ||
+      !ch->enabled || ch->gpio > MAX_GPIO_PIN || ch->pulse_us <= 0
+    ) {
+      schedule->period_us[i] = 0;
+      continue;
+    }
+
+    uint32_t period_us = servo_period_us(ch);
+    if (period_us != schedule->period_us[i]) {
+      schedule->period_us[i] = period_us;
+      schedule->next_rise_us[i] = PWM_CHANNEL_SLOT(i) * PWM_SLOT_US % period_us;
+    }
+
+    if (PWM_FRAME_US % period_us != 0) {
+      schedule->periodic = false;
+    }
+
+    uint32_t bit = GPIO_BIT(ch->gpio);
+    schedule->pin_mask |= bit;
+
+    uint32_t pulse_us = (uint32_t) ch->pulse_us < period_us ? (uint32_t) ch->pulse_us : period_us - 1;
+    uint32_t rise_us = schedule->next_rise_us[i];
+
+    for (; rise_us < PWM_FRAME_US; rise_us += period_us) {
+      uint32_t fall_us = rise_us + pulse_us;
+
+      schedule->events[count++] = (PwmEvent) {rise_us, bit, 0, 1ULL << i};
+
+      if (fall_us < PWM_FRAME_US) {
+        schedule->events[count++] = (PwmEvent) {fall_us, 0, bit, 1ULL << i};
+      } else {
+        schedule->carry[schedule->num_carry++] = (PwmEvent) {
+          fall_us - PWM_FRAME_US, 0, bit, 1ULL << i
+        };
+      }
+    }
+
+    schedule->next_rise_us[i] = rise_us - PWM_FRAME_US;
+  }
+
+  schedule->num_events = pwm_sort_events(schedule->events, count);
+  schedule->num_carry = pwm_sort_events(schedule->carry, schedule->num_carry);
+}
+
+static int16_t pwm_clamp_pulse(const ServoChannel *ch, int32_t pulse_us) {
+  if (pulse_us < ch->min_us) {
+    return ch->min_us;
+  }
+
+  return pulse_us > ch->max_us ? ch->max_us : pulse_us;
+}
+
+/**
+ * Shard driving a channel, channels naming a shard that is not running
+ * fall back to the first one
+ */
+static uint8_t pwm_channel_shard(const ServoChannel *ch) {
+  return ch->shard < engine.num_shards ? ch->shard : 0;
+}
+
+/**
+ * Whether every other shard is done with a channel moved to this one
+ *
+ * A shard acknowledges a table once the last edge compiled from an older
+ * one ran, so two shards never drive the same pin or record edges for the
+ * same channel in one frame.
+ */
+static bool pwm_handed_over(const PwmShard *shard, const PwmTable *table, int channel) {
+  for (uint8_t i = 0; i < engine.num_shards; i++) {
+    if (i == shard->index) {
+      continue;
+    }
+
+    unsigned acked = atomic_load_explicit(&engine.shards[i].acked_seq, memory_order_acquire);
+    if ((int) (acked - table->moved_seq[channel]) < 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Install a published table
+ *
+ * A pulse that arrived through shared memory or a move stays in place
+ * unless the socket side set that channel's pulse since, it is only clamped
+ * to a possibly changed range. A new pulse cancels a running move, a new
+ * move starts from wherever the channel is. A channel handed over by
+ * another shard continues from the last pulse that shard output.
+ */
+static void pwm_take_table(PwmShard *shard, PwmTable *copy) {
+  uint64_t owned = 0;
+
+  shard->pending = 0;
+  for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    if (pwm_channel_shard(&copy->channels[i]) != shard->index) {
+      continue;
+    }
+
+    if (pwm_handed_over(shard, copy, i)) {
+      owned |= 1ULL << i;
+    } else {
+      shard->pending |= 1ULL << i;
+    }
+  }
+
+  for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    ServoChannel *ch = &copy->channels[i];
+    const ServoChannel *old = &shard->table.channels[i];
+    uint64_t bit = 1ULL << i;
+
+    if (ch->gpio == 0 || ch->pulse_gen != old->pulse_gen) {
+      motion_stop(&shard->motion[i]);
+    } else if ((owned & bit) && !(shard->channels & bit)) {
+      uint64_t live = atomic_load_explicit(&live_pulses[i], memory_order_relaxed);
+
+      motion_stop(&shard->motion[i]);
+      if ((uint32_t) (live >> 32) == ch->pulse_gen) {
+        ch->pulse_us = pwm_clamp_pulse(ch, (int16_t) (live & 0xffff));
+      }
+    } else {
+      ch->pulse_us = pwm_clamp_pulse(ch, old->pulse_us);
+    }
+
+    if ((owned & bit) && ch->gpio != 0 && ch->move.gen != old->move.gen) {
+      motion_start(
+        &shard->motion[i], ch->pulse_us, ch->move.target_us,
+        ch->move.vel_us_s, ch->move.acc_us_s2
+      );
+    }
+  }
+
+  shard->table = *copy;
+  shard->channels = owned;
+}
+
+/**
+ * Advance every running move by one frame
+ *
+ * @return true if any pulse changed
+ */
+static bool pwm_step_motion(PwmShard *shard) {
+  bool changed = false;
+
+  for (uint64_t mask = shard->channels; mask; mask &= mask - 1) {
+    int i = __builtin_ctzll(mask);
+
+    if (!shard->motion[i].active) {
+      continue;
+    }
+
+    ServoChannel *ch = &shard->table.channels[i];
+    int16_t pulse_us = pwm_clamp_pulse(ch, motion_step(&shard->motion[i]));
+
+    if (pulse_us != ch->pulse_us) {
+      ch->pulse_us = pulse_us;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+/**
+ * Apply pulses written to the shared memory segment since the last frame
+ *
+ * @return true if any pulse changed
+ */
+static bool pwm_poll_shm(PwmShard *shard) {
+  if (!shm_active()) {
+    return false;
+  }
+
+  bool changed = false;
+
+  for (uint8_t i = 0; i < shard->table.num_channels; i++) {
+    ServoChannel *ch = &shard->table.channels[i];
+    uint16_t pulse_us;
+
+    // Slots of other shards' channels are left to them
+    if (!(shard->channels & (1ULL << i))) {
+      continue;
+    }
+
+    // Unconfigured channels still consume the write
+    if (!shm_poll_pulse(i, &pulse_us) || ch->gpio == 0) {
+      continue;
+    }
+
+    // Direct writes take over from a running move
+    motion_stop(&shard->motion[i]);
+
+    int16_t clamped = pwm_clamp_pulse(ch, pulse_us);
+    if (clamped != ch->pulse_us) {
+      ch->pulse_us = clamped;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+/**
+ * Export the pulses of the shard's channels for pwm_current_pulse()
+ */
+static void pwm_store_live_pulses(const PwmShard *shard) {
+  for (uint64_t mask = shard->channels; mask; mask &= mask - 1) {
+    int i = __builtin_ctzll(mask);
+    const ServoChannel *ch = &shard->table.channels[i];
+    uint64_t live = (uint64_t) ch->pulse_gen << 32 | (uint16_t) ch->pulse_us;
+
+    atomic_store_explicit(&live_pulses[i], live, memory_order_relaxed);
+  }
+}
+
+/**
+ * Copy the shared table into the shard if a newer one was published
+ *
+ * Never blocks: if the writer keeps racing us the old table stays in use and
+ * the update is picked up on the next frame.
+ *
+ * @return true if the shard's table changed
+ */
+static bool pwm_fetch_table(PwmShard *shard) {
+  for (int attempt = 0; attempt < PWM_SNAPSHOT_RETRIES; attempt++) {
+    unsigned seq = atomic_load_explicit(&shared_seq, memory_order_acquire);
+    if (seq == shard->table_seq) {
+      return false;
+    }
+
+    if (seq & 1) {
+      continue;
+    }
+
+    PwmTable copy;
+    memcpy(&copy, &shared_table, sizeof(copy));
+    atomic_thread_fence(memory_order_acquire);
+
+    if (atomic_load_explicit(&shared_seq, memory_order_relaxed) == seq) {
+      pwm_take_table(shard, &copy);
+      shard->table_seq = seq;
+      return true;
+    }
+  }
 
-  if (sched_setscheduler(0, SCHED_FIFO, &sp) != 0) {
+  return false;
+}
+
+/**
+ * Take over channels whose previous shard let go of them since
+ *
+ * @return true if the shard's channels changed
+ */
+static bool pwm_take_pending(PwmShard *shard) {
+  for (uint64_t mask = shard->pending; mask; mask &= mask - 1) {
+    if (pwm_handed_over(shard, &shard->table, __builtin_ctzll(mask))) {
+      PwmTable copy = shard->table;
+
+      pwm_take_table(shard, &copy);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void pwm_close_timers(void) {
+  for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+    PwmShard *shard = &engine.shards[i];
+
+    if (shard->timer_fd >= 0) {
+      close(shard->timer_fd);
+      shard->timer_fd = -1;
+    }
+
+    shard->armed = false;
+  }
+}
+
+/**
+ * Initialize PWM system
+ */
+bool pwm_init(ServoController *controller) {
+  if (!controller) {
+    return false;
+  }
+
+  // Do not leak timers if init is called twice
+  pwm_close_timers();
+
+  // Virtual time needs neither a timer nor a spin phase
+  if (timebase_is_virtual()) {
+    pwm_set_spin(false);
+    pwm_publish(controller);
+
+    return true;
+  }
+
+  // One timer per shard, each thread blocks on its own
+  for (uint8_t i = 0; i < engine.num_shards; i++) {
+    engine.shards[i].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if (engine.shards[i].timer_fd < 0) {
+      fprintf(stderr, "Error: Could not create timerfd: %s\n", strerror(errno));
+      pwm_close_timers();
+      return false;
+    }
+  }
+
+  pwm_publish(controller);
+
+  return true;
+}
+
+/**
+ * Publish the controller's channel table to the PWM thread
+ *
+ * Lock-free: the PWM thread picks the new table up at its next frame.
+ * Must only be called from a single thread.
+ */
+void pwm_publish(const ServoController *controller) {
+  if (!controller) {
+    return;
+  }
+
+  unsigned seq = atomic_load_explicit(&shared_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&shared_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  // The previous table is still in place, only this thread writes it
+  for (int i = 0; i < MAX_SERVO_CHANNELS; i++) {
+    if (pwm_channel_shard(&controller->channels[i]) != pwm_channel_shard(&shared_table.channels[i])) {
+      shared_table.moved_seq[i] = seq + 2;
+    }
+  }
+
+  memcpy(shared_table.channels, controller->channels, sizeof(shared_table.channels));
+  shared_table.num_channels = controller->num_channels;
+
+  atomic_store_explicit(&shared_seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Pulse a channel is driven with
+ *
+ * Includes pulses written through shared memory. A pulse the controller set
+ * that the PWM thread has not taken over yet wins, so a SET PULSE is
+ * visible right away.
+ */
+int16_t pwm_current_pulse(const ServoController *controller, uint8_t channel) {
+  if (!controller || channel >= MAX_SERVO_CHANNELS) {
+    return 0;
+  }
+
+  const ServoChannel *ch = &controller->channels[channel];
+  uint64_t live = atomic_load_explicit(&live_pulses[channel], memory_order_relaxed);
+
+  if ((uint32_t) (live >> 32) != ch->pulse_gen) {
+    return ch->pulse_us;
+  }
+
+  return (int16_t) (live & 0xffff);
+}
+
+static void pwm_run_shard_frame(PwmShard *shard);
+
+static void *pwm_thread(void *arg) {
+  PwmShard *shard = arg;
+  char name[16] = "PWM thread";
+
+  if (engine.num_shards > 1) {
+    snprintf(name, sizeof(name), "PWM shard %u", shard->index);
+  }
+
+  stats_set_shard(shard->index);
+
+  // Pin first, so the priority applies on the CPU the thread stays on
+  if (shard->cpu >= 0) {
+    if (rt_set_cpu(shard->cpu)) {
+      printf("%s pinned to CPU %d\n", name, shard->cpu);
+    } else {
+      fprintf(
+        stderr, "Warning: Could not pin %s to CPU %d: %s\n",
+        name, shard->cpu, strerror(errno)
+      );
+    }
+  }
+
+  // Try to set real-time priority for better timing accuracy
+  if (rt_set_priority(engine.priority)) {
+    printf("%s running at SCHED_FIFO priority %d\n", name, engine.priority);
+  } else {
     fprintf(
       stderr,
       "Warning: Could not set real-time priority: %s\n",
@@ -72,97 +789,386 @@ bool pwm_init(ServoController *controller) {
     fprintf(stderr, "Run with 'sudo' or 'chrt -f 99' for better timing.\n");
   }
 
+  if (engine.prefault_stack > 0) {
+    size_t faulted = rt_prefault_stack(engine.prefault_stack);
+
+    if (faulted < engine.prefault_stack) {
+      fprintf(
+        stderr, "Warning: %s stack only has room to prefault %zu KB\n",
+        name, faulted / 1024
+      );
+    }
+
+    printf("%s stack prefaulted (%zu KB)\n", name, faulted / 1024);
+  }
+
+  if (engine.spin_enabled) {
+    shard->spin_us = pwm_calibrate_spin();
+    printf("%s spin threshold calibrated to %u us\n", name, shard->spin_us);
+  }
+
+  // Frames start counting from here, 20ms periodic
+  if (!pwm_arm_shard(shard)) {
+    return NULL;
+  }
+
+  while (atomic_load_explicit(&engine.running, memory_order_relaxed)) {
+    pwm_run_shard_frame(shard);
+  }
+
+  return NULL;
+}
+
+/**
+ * Enable or disable the busy-wait phase before each edge
+ */
+void pwm_set_spin(bool enabled) {
+  engine.spin_enabled = enabled;
+  if (!enabled) {
+    for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+      engine.shards[i].spin_us = 0;
+    }
+  }
+}
+
+void pwm_set_priority(int priority) {
+  engine.priority = priority;
+}
+
+void pwm_set_cpu(int cpu) {
+  engine.cpu = cpu;
+}
+
+void pwm_set_prefault_stack(size_t bytes) {
+  engine.prefault_stack = bytes;
+}
+
+void pwm_set_overrun_policy(PwmOverrunPolicy policy) {
+  engine.overrun_policy = policy;
+}
+
+bool pwm_set_shards(unsigned count) {
+  if (count < 1 || count > PWM_MAX_SHARDS) {
+    return false;
+  }
+
+  engine.num_shards = count;
   return true;
 }
 
+uint64_t pwm_common_frame(void) {
+  uint64_t now = timebase_now_ns();
+
+  if (now < engine.first_frame_ns) {
+    return 1;
+  }
+
+  // A shard may already be past its pulses for the frame after this one
+  return (now - engine.first_frame_ns) / PWM_FRAME_NS + 2;
+}
+
+unsigned pwm_num_shards(void) {
+  return engine.num_shards;
+}
+
 /**
- * Run one PWM frame (20ms cycle)
+ * CPU for each shard: consecutive CPUs from the one given with
+ * pwm_set_cpu(), otherwise the highest numbered ones, leaving CPU 0 to the
+ * socket thread and interrupts. A single shard is only pinned on request.
  */
-void pwm_run_frame(ServoController *controller) {
-  if (!controller || timer_fd < 0) {
+static void pwm_assign_cpus(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (uint8_t i = 0; i < engine.num_shards; i++) {
+    PwmShard *shard = &engine.shards[i];
+
+    if (engine.cpu >= 0) {
+      shard->cpu = engine.cpu + i;
+    } else if (engine.num_shards == 1 || online < 1) {
+      shard->cpu = -1;
+    } else if (online >= engine.num_shards) {
+      shard->cpu = online - engine.num_shards + i;
+    } else {
+      shard->cpu = i % online;
+    }
+  }
+}
+
+/**
+ * Start the real-time PWM threads, one per shard
+ */
+bool pwm_start(void) {
+  for (uint8_t i = 0; i < engine.num_shards; i++) {
+    if (engine.shards[i].timer_fd < 0 || engine.shards[i].thread_started) {
+      return false;
+    }
+  }
+
+  pwm_assign_cpus();
+
+  // Every shard arms on this grid, whenever its setup is done
+  engine.first_frame_ns = timebase_now_ns() + PWM_FRAME_NS;
+
+  // The prefaulted stack must fit, whatever RLIMIT_STACK says
+  pthread_attr_t attr;
+  size_t stack_size;
+
+  pthread_attr_init(&attr);
+  pthread_attr_getstacksize(&attr, &stack_size);
+  if (stack_size < engine.prefault_stack + PWM_STACK_HEADROOM) {
+    pthread_attr_setstacksize(&attr, engine.prefault_stack + PWM_STACK_HEADROOM);
+  }
+
+  // Signals are handled by the main thread only
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  atomic_store(&engine.running, true);
+
+  int err = 0;
+  for (uint8_t i = 0; i < engine.num_shards && err == 0; i++) {
+    PwmShard *shard = &engine.shards[i];
+
+    err = pthread_create(&shard->thread, &attr, pwm_thread, shard);
+    shard->thread_started = err == 0;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+
+  if (err != 0) {
+    fprintf(stderr, "Error: Could not start PWM thread: %s\n", strerror(err));
+    pwm_stop();
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Stop the real-time PWM threads, waits for their current frames to finish
+ */
+void pwm_stop(void) {
+  atomic_store(&engine.running, false);
+
+  for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+    PwmShard *shard = &engine.shards[i];
+
+    if (shard->thread_started) {
+      pthread_join(shard->thread, NULL);
+      shard->thread_started = false;
+    }
+  }
+}
+
+/**
+ * Record why a frame started late, blaming the part of the previous frame
+ * that ran past the timer of the first start that was missed
+ */
+static void pwm_record_overrun(
+  const PwmShard *shard, uint64_t frame_start, uint64_t now, uint64_t expirations
+) {
+  uint64_t missed_start = frame_start - (expirations - 1) * PWM_FRAME_NS;
+  uint64_t wake = missed_start - shard->spin_us * NS_PER_US;
+
+  StatsOverrun overrun = {
+    .frame = shard->ticks,
+    .late_us = now > missed_start ? (now - missed_start) / NS_PER_US : 0,
+    .duration_us = (shard->last_done_ns - shard->last_start_ns) / NS_PER_US,
+    .missed = expirations - 1,
+    .cause = STATS_CAUSE_WAKEUP
+  };
+
+  if (shard->last_edges_ns > wake) {
+    overrun.cause = STATS_CAUSE_EDGES;
+  } else if (shard->last_done_ns > wake) {
+    overrun.cause = STATS_CAUSE_PROCESSING;
+  }
+
+  stats_record_overrun(&overrun);
+}
+
+/**
+ * Run one PWM frame (20ms cycle) of a shard
+ */
+static void pwm_run_shard_frame(PwmShard *shard) {
+  if (!shard->armed) {
     return;
   }
 
   // Wait for timer expiration (blocks until 20ms frame boundary)
   uint64_t expirations;
-  ssize_t bytes_read = read(timer_fd, &expirations, sizeof(expirations));
-
-  if (bytes_read < 0) {
-    fprintf(stderr, "Error: timerfd read failed: %s\n", strerror(errno));
+  if (!pwm_wait_tick(shard, &expirations)) {
     return;
   }
 
   // Check for frame overruns
   if (expirations > 1) {
-    fprintf(stderr, "Warning: Missed %lu PWM frames\n", expirations - 1);
+    log_push(LOG_MISSED_FRAMES, expirations - 1, 0);
   }
 
-  // Step 1: Set all enabled channels HIGH
-  for (uint8_t i = 0; i < controller->num_channels; i++) {
-    ServoChannel *ch = &controller->channels[i];
-    if (ch->enabled && ch->gpio <= MAX_GPIO_PIN) {
-      gpio_set(ch->gpio);
-    }
-  }
+  shard->ticks += expirations;
+  uint64_t frame_start = engine.first_frame_ns + (shard->ticks - 1) * PWM_FRAME_NS;
+
+  uint64_t now = timebase_now_ns();
+  stats_record_wakeup(now > frame_start);
+
+  const PwmSchedule *schedule = &shard->schedule;
+  uint16_t num_events = schedule->num_events;
+  // Carried falls end pulses of the previous frame, so they stay on its
+  // timeline even when this frame is shifted
+  uint64_t event_start = frame_start;
+  uint64_t carry_start = shard->carry_start_ns;
 
-  // Step 2: Clear channels one by one as their pulse width expires
-  // Sort channels by pulse_us for efficient timing
-  uint8_t sorted[MAX_SERVO_CHANNELS];
-  for (uint8_t i = 0; i < controller->num_channels; i++) {
-    sorted[i] = i;
+  // Late once the first edge can no longer be placed close to its deadline
+  bool late = num_events > 0 && now > frame_start + (
+    schedule->events[0].offset_us + PWM_LATE_TOLERANCE_US
+  ) * NS_PER_US;
+
+  if (late || expirations > 1) {
+    pwm_record_overrun(shard, frame_start, now, expirations);
   }
 
-  // Simple bubble sort by pulse_us (good enough for 8 channels) and avoids
-  // pulling in stdlib.
-  for (uint8_t i = 0; i < controller->num_channels - 1; i++) {
-    for (uint8_t j = 0; j < controller->num_channels - i - 1; j++) {
-      if (
-        controller->channels[sorted[j]].pulse_us >
-        controller->channels[sorted[j + 1]].pulse_us
-      ) {
-        uint8_t temp = sorted[j];
-        sorted[j] = sorted[j + 1];
-        sorted[j + 1] = temp;
-      }
+  if (late) {
+    switch (engine.overrun_policy) {
+      // Keep pulse widths intact by shifting the frame's own edges
+      case PWM_OVERRUN_CATCHUP: {
+        event_start = now - schedule->events[0].offset_us * NS_PER_US;
+      } break;
+
+      // Rises stay on the period grid, carried falls still end their pulses
+      case PWM_OVERRUN_REALIGN: {
+        num_events = 0;
+      } break;
+
+      case PWM_OVERRUN_SKIP: {
+        uint32_t pins = schedule->pin_mask;
+        for (uint8_t i = 0; i < shard->num_carry_in; i++) {
+          pins |= shard->carry_in[i].clear_mask;
+        }
+
+        gpio_clear_mask(pins);
+        num_events = 0;
+        shard->num_carry_in = 0;
+      } break;
     }
   }
 
-  // Step 3: Process each channel in sorted order
-  uint32_t prev_pulse_us = 0;
-  for (uint8_t i = 0; i < controller->num_channels; i++) {
-    ServoChannel *ch = &controller->channels[sorted[i]];
+  // Walk the precompiled edges merged with the falls carried over from the
+  // last frame, one register write per mask
+  uint16_t next_event = 0;
+  uint8_t next_carry = 0;
+  uint32_t worst_late_us = 0;
 
-    if (!ch->enabled) {
-      continue;
+  while (next_event < num_events || next_carry < shard->num_carry_in) {
+    bool take_event = next_event < num_events;
+    bool take_carry = next_carry < shard->num_carry_in;
+
+    uint64_t event_ns = take_event ?
+      event_start + schedule->events[next_event].offset_us * NS_PER_US : UINT64_MAX;
+    uint64_t carry_ns = take_carry ?
+      carry_start + shard->carry_in[next_carry].offset_us * NS_PER_US : UINT64_MAX;
+
+    take_event = event_ns <= carry_ns;
+    take_carry = carry_ns <= event_ns;
+
+    PwmEvent event = {0, 0, 0, 0};
+    if (take_event) {
+      event = schedule->events[next_event++];
+    }
+
+    if (take_carry) {
+      const PwmEvent *carry = &shard->carry_in[next_carry++];
+
+      event.clear_mask |= carry->clear_mask;
+      event.channels |= carry->channels;
     }
 
-    // Sleep for the delta between this pulse and the previous
-    uint32_t delta_us = ch->pulse_us - prev_pulse_us;
-    if (delta_us > 0) {
-      sleep_us(delta_us);
+    // Every edge has its own absolute deadline measured from its frame start
+    uint64_t deadline = take_event ? event_ns : carry_ns;
+    sleep_until(shard, deadline);
+
+    // Clear first, a pin reused by the next slot then starts a new pulse
+    if (event.clear_mask) {
+      gpio_clear_mask(event.clear_mask);
+    }
+
+    if (event.set_mask) {
+      gpio_set_mask(event.set_mask);
+    }
+
+    uint64_t done = timebase_now_ns();
+    uint32_t late_us = done > deadline ? (done - deadline) / NS_PER_US : 0;
+
+    if (late_us > worst_late_us) {
+      worst_late_us = late_us;
     }
 
-    gpio_clear(ch->gpio);
+    for (uint64_t mask = event.channels; mask; mask &= mask - 1) {
+      stats_record_edge(__builtin_ctzll(mask), late_us);
+    }
+  }
+
+  // The wakeup, a frame without edges can finish before frame_start
+  shard->last_start_ns = now;
+  shard->last_edges_ns = timebase_now_ns();
+
+  stats_record_frame(worst_late_us, expirations - 1);
+  stats_apply_reset(shard->channels);
+
+  // Every edge of tables up to the one the carried falls came from has run
+  atomic_store_explicit(&shard->acked_seq, shard->carry_seq, memory_order_release);
+  unsigned schedule_seq = shard->table_seq;
+
+  // Pick up changes in the idle part of the frame so the next one starts
+  // with a ready schedule
+  bool changed = pwm_fetch_table(shard);
+  changed |= pwm_take_pending(shard);
+  changed |= pwm_poll_shm(shard);
+  changed |= pwm_step_motion(shard);
+  changed |= keyframe_step(
+    &shard->keyframes, shard->table.channels, shard->table.num_channels,
+    shard->channels, shard->ticks, PWM_FRAME_US
+  );
 
-    prev_pulse_us = ch->pulse_us;
+  // Falls spilling out of this frame run at the start of the next one,
+  // unless the late frame dropped the rises those falls would end
+  if (num_events < schedule->num_events) {
+    shard->num_carry_in = 0;
+  } else {
+    memcpy(shard->carry_in, schedule->carry, schedule->num_carry * sizeof(PwmEvent));
+    shard->num_carry_in = schedule->num_carry;
   }
+  shard->carry_start_ns = event_start + PWM_FRAME_NS;
+  shard->carry_seq = schedule_seq;
+
+  // Channels whose period does not divide the frame shift every window
+  if (changed || !schedule->periodic) {
+    pwm_compile(&shard->table, shard->channels, &shard->schedule);
+  }
+
+  if (changed) {
+    pwm_store_live_pulses(shard);
+  }
+
+  shard->last_done_ns = timebase_now_ns();
 
   // Note: No manual sleep needed - timerfd handles frame timing
   // Next call to pwm_run_frame() will block until the next 20ms boundary
 }
 
+/**
+ * Run one frame of the first shard, for frames run by hand
+ */
+void pwm_run_frame(void) {
+  pwm_run_shard_frame(&engine.shards[0]);
+}
+
 /**
  * Cleanup PWM resources
  */
 void pwm_cleanup(void) {
-  if (timer_fd >= 0) {
-    close(timer_fd);
-    timer_fd = -1;
-  }
-
-  // Reset scheduler priority
-  struct sched_param sp;
-  sp.sched_priority = 0;
-
-  sched_setscheduler(0, SCHED_OTHER, &sp);
+  pwm_stop();
+  pwm_close_timers();
 }
@@ -1,10 +1,53 @@
 #ifndef PWM_H
 #define PWM_H
 
+#include <stddef.h>
+
 #include "servo.h"
 
+#define PWM_DEFAULT_PRIORITY 99
+
+// What a frame that wakes up after its start does
+typedef enum {
+  PWM_OVERRUN_CATCHUP,  // Run the whole frame right away, shifted (default)
+  PWM_OVERRUN_REALIGN,  // Only finish carried pulses, start again on the next boundary
+  PWM_OVERRUN_SKIP      // Drop every output low and wait for the next boundary
+} PwmOverrunPolicy;
+
 bool pwm_init(ServoController *controller);
-void pwm_run_frame(ServoController *controller);
+// Busy-wait the last few microseconds before each edge (default on)
+void pwm_set_spin(bool enabled);
+// Real-time setup of the PWM thread, applied when pwm_start() spawns it
+void pwm_set_priority(int priority);
+// Pin the first shard to one CPU and the others to the CPUs after it, -1
+// (default) leaves a single shard free to migrate
+void pwm_set_cpu(int cpu);
+// Fault in this much stack before the first frame (default 0)
+void pwm_set_prefault_stack(size_t bytes);
+void pwm_set_overrun_policy(PwmOverrunPolicy policy);
+/**
+ * Split channels over this many PWM threads, 1-PWM_MAX_SHARDS, each with
+ * its own timer and CPU. Call before pwm_init().
+ *
+ * @return false if the count is out of range
+ */
+bool pwm_set_shards(unsigned count);
+unsigned pwm_num_shards(void);
+// First frame of the grid that no shard has computed its pulses for yet,
+// so a change latched to it starts on the same frame everywhere
+uint64_t pwm_common_frame(void);
+// Start counting frames on the first shard, done by pwm_start() unless
+// frames are run by hand
+bool pwm_arm(void);
+// Spawn the SCHED_FIFO threads that run frames until pwm_stop()
+bool pwm_start(void);
+void pwm_stop(void);
+// Hand a new channel table to the PWM thread without blocking it
+void pwm_publish(const ServoController *controller);
+// Pulse being output, including updates made through shared memory
+int16_t pwm_current_pulse(const ServoController *controller, uint8_t channel);
+// Wait for the next frame boundary and run one frame, on the first shard
+void pwm_run_frame(void);
 void pwm_cleanup(void);
 
 #endif /* PWM_H */
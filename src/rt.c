@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+bool rt_lock_memory(void) {
+  return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+bool rt_prefault_heap(size_t bytes) {
+  if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+    errno = EINVAL;
+    return false;
+  }
+
+  char *heap = malloc(bytes);
+  if (!heap) {
+    return false;
+  }
+
+  // One write per page is enough to fault it in
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < bytes; i += page) {
+    ((volatile char *) heap)[i] = 0;
+  }
+
+  free(heap);
+  return true;
+}
+
+size_t rt_prefault_stack(size_t bytes) {
+  pthread_attr_t attr;
+  void *stack_addr;
+  size_t stack_size;
+
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return 0;
+  }
+
+  int err = pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    return 0;
+  }
+
+  // Stop a page short of the lowest usable address
+  long page = sysconf(_SC_PAGESIZE);
+  char here;
+  uintptr_t top = (uintptr_t) &here;
+  uintptr_t bottom = (uintptr_t) stack_addr + page;
+
+  if (top <= bottom) {
+    return 0;
+  }
+
+  if (bytes > top - bottom) {
+    bytes = top - bottom;
+  }
+
+  // One write per page, below the frames in use, so nothing is allocated
+  // on the stack itself
+  volatile char *low = (volatile char *) (top - bytes);
+  for (size_t offset = page; offset <= bytes; offset += page) {
+    low[bytes - offset] = 0;
+  }
+
+  return bytes;
+}
+
+bool rt_set_cpu(int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0) {
+    errno = err;
+    return false;
+  }
+
+  return true;
+}
+
+bool rt_set_priority(int priority) {
+  struct sched_param sp;
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = priority;
+
+  int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+  if (err != 0) {
+    errno = err;
+    return false;
+  }
+
+  return true;
+}
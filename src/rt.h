@@ -0,0 +1,37 @@
+#ifndef RT_H
+#define RT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Real-time setup helpers. Each returns false with errno set when the
+ * setting did not take effect, callers report it and carry on.
+ */
+
+// Lock current and future pages into RAM, so the PWM path never page faults
+bool rt_lock_memory(void);
+
+/**
+ * Fault in heap pages once and keep them
+ *
+ * Freed memory is no longer returned to the kernel and large blocks come
+ * from the heap as well, so later allocations reuse the faulted pages.
+ */
+bool rt_prefault_heap(size_t bytes);
+
+/**
+ * Touch the calling thread's stack down to bytes below the current frame
+ *
+ * @return Bytes faulted in, less than asked for when the thread's stack
+ *         is smaller
+ */
+size_t rt_prefault_stack(size_t bytes);
+
+// Pin the calling thread to one CPU
+bool rt_set_cpu(int cpu);
+
+// Run the calling thread at SCHED_FIFO with the given priority
+bool rt_set_priority(int priority);
+
+#endif /* RT_H */
@@ -139,3 +139,14 @@ bool servo_set_pulse(ServoChannel *channel, int16_t pulse_us) {
 
   return (pulse_us == original);
 }
+
+/**
+ * Period of a channel's frame rate in microseconds
+ */
+uint32_t servo_period_us(const ServoChannel *channel) {
+  if (!channel || channel->rate_hz == 0) {
+    return PWM_FRAME_US;
+  }
+
+  return SERVO_PERIOD_US(channel->rate_hz);
+}
@@ -14,19 +14,54 @@
 #define SERVO_ABSOLUTE_MIN  500
 #define SERVO_ABSOLUTE_MAX  2500
 
-#define MAX_SERVO_CHANNELS  8
+#define MAX_SERVO_CHANNELS  64
+
+// Per channel frame rates, see SET RATE
+#define SERVO_MIN_RATE_HZ   50
+#define SERVO_MAX_RATE_HZ   400
+#define SERVO_PERIOD_US(hz) ((1000000 + (hz) / 2) / (hz))
+
+// Limits for MOVE, in us/s and us/s^2
+#define SERVO_MAX_VEL       100000
+#define SERVO_MAX_ACC       10000000
+
+/*
+ * The frame is split into phase-offset slots. Each slot drives its own group
+ * of channels, so pulses only need to fit in their slot and rising edges of
+ * different groups are staggered.
+ */
+#define PWM_SLOTS           8
+#define PWM_SLOT_US         (PWM_FRAME_US / PWM_SLOTS)
+#define CHANNELS_PER_SLOT   (MAX_SERVO_CHANNELS / PWM_SLOTS)
+#define PWM_CHANNEL_SLOT(ch) ((ch) / CHANNELS_PER_SLOT)
 #define MAX_GPIO_PIN        27
 
+// PWM engine threads, one per core of a Raspberry Pi
+#define PWM_MAX_SHARDS      4
+
 #define SOCKET_PATH         "/tmp/piservod.sock"
 #define SOCKET_BACKLOG      5
 #define SOCKET_BUFFER_SIZE  256
 
+// Latest MOVE for a channel, run by the PWM thread
+typedef struct {
+    int16_t  target_us;
+    uint32_t vel_us_s;
+    uint32_t acc_us_s2;
+    uint32_t gen;         // Bumped for every MOVE
+} ServoMove;
+
 typedef struct {
     uint8_t  gpio;
     uint8_t  enabled;
     int16_t  min_us;
     int16_t  max_us;
     int16_t  pulse_us;
+    uint32_t pulse_gen;   // Bumped whenever the socket side sets pulse_us
+    uint16_t rate_hz;     // 0 for the default PWM_FREQUENCY_HZ
+    uint8_t  shard;       // PWM thread driving the channel
+    bool     shard_fixed; // Set with SET SHARD, otherwise picked on ENABLE
+    ServoMove move;
 } ServoChannel;
 
 typedef struct {
@@ -45,5 +80,7 @@ void servo_disable(ServoChannel *channel);
 bool servo_set_range(ServoChannel *channel, int16_t min_us, int16_t max_us);
 // Returns false if pulse had to be clamped
 bool servo_set_pulse(ServoChannel *channel, int16_t pulse_us);
+// Period of the channel's own frame rate
+uint32_t servo_period_us(const ServoChannel *channel);
 
 #endif /* SERVO_H */
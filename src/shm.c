@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm.h"
+
+static ShmTable *table = NULL;
+static char table_name[64];
+
+// Last sequence taken from each slot, only touched by the PWM thread
+static uint32_t seen_seq[MAX_SERVO_CHANNELS];
+
+bool shm_create(const char *name) {
+  if (!name || name[0] != '/' || strlen(name) >= sizeof(table_name)) {
+    fprintf(stderr, "Invalid shared memory name: %s\n", name ? name : "");
+    return false;
+  }
+
+  int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    perror("Failed creating shared memory");
+    return false;
+  }
+
+  // Same access rules as the socket, regardless of umask
+  if (fchmod(fd, 0666) < 0 || ftruncate(fd, sizeof(ShmTable)) < 0) {
+    perror("Failed sizing shared memory");
+    close(fd);
+    shm_unlink(name);
+
+    return false;
+  }
+
+  void *map = mmap(NULL, sizeof(ShmTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    perror("Failed mapping shared memory");
+    shm_unlink(name);
+
+    return false;
+  }
+
+  table = map;
+  strcpy(table_name, name);
+
+  // A segment left behind by a crashed daemon starts over
+  memset(table, 0, sizeof(ShmTable));
+  memset(seen_seq, 0, sizeof(seen_seq));
+
+  table->version = SHM_VERSION;
+  table->num_channels = MAX_SERVO_CHANNELS;
+  table->slot_size = sizeof(ShmChannel);
+
+  // Clients check the magic last, everything above is valid once it is set
+  atomic_thread_fence(memory_order_release);
+  table->magic = SHM_MAGIC;
+
+  return true;
+}
+
+void shm_destroy(void) {
+  if (!table) {
+    return;
+  }
+
+  munmap(table, sizeof(ShmTable));
+  shm_unlink(table_name);
+  table = NULL;
+}
+
+bool shm_active(void) {
+  return table != NULL;
+}
+
+bool shm_poll_pulse(uint8_t channel, uint16_t *pulse_us) {
+  if (!table || channel >= MAX_SERVO_CHANNELS) {
+    return false;
+  }
+
+  ShmChannel *slot = &table->channels[channel];
+
+  uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (seq == seen_seq[channel] || (seq & 1)) {
+    // Unchanged, or a write in progress that is picked up next frame
+    return false;
+  }
+
+  uint32_t value = atomic_load_explicit(&slot->pulse_us, memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+
+  if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+    return false;
+  }
+
+  seen_seq[channel] = seq;
+  *pulse_us = value > UINT16_MAX ? UINT16_MAX : value;
+
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "servo.h"
+
+#define SHM_NAME    "/piservod"
+#define SHM_MAGIC   0x50535631  // "PSV1"
+#define SHM_VERSION 1
+
+/*
+ * Shared memory control plane. The daemon creates the segment, clients map
+ * it read-write and stream pulse widths into the channel slots without any
+ * syscall. Channels still have to be set up and enabled over the socket;
+ * pulses for unconfigured channels are ignored and all others are clamped
+ * to the channel's range.
+ *
+ * Each slot is a seqlock with a single writer. To set a pulse:
+ *
+ *   uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+ *   atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+ *   atomic_thread_fence(memory_order_release);
+ *   atomic_store_explicit(&slot->pulse_us, pulse, memory_order_relaxed);
+ *   atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+ *
+ * The PWM thread samples every slot at the frame boundary, so the pulse is
+ * output from the next frame on. Slots are one cache line each, writers of
+ * different channels do not contend.
+ */
+typedef struct {
+  _Alignas(64) atomic_uint_least32_t seq;  // Odd while a write is in progress
+  atomic_uint_least32_t pulse_us;
+} ShmChannel;
+
+typedef struct {
+  uint32_t   magic;
+  uint32_t   version;
+  uint32_t   num_channels;
+  uint32_t   slot_size;
+  ShmChannel channels[MAX_SERVO_CHANNELS];
+} ShmTable;
+
+// Create (or take over) the named segment, mode 0666 like the socket
+bool shm_create(const char *name);
+// Unmap and unlink the segment
+void shm_destroy(void);
+bool shm_active(void);
+/**
+ * Check a slot for a completed write since the last call (PWM thread only)
+ *
+ * @return true if pulse_us holds a new value
+ */
+bool shm_poll_pulse(uint8_t channel, uint16_t *pulse_us);
+
+#endif /* SHM_H */
@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Halve all buckets once one gets this full, keeps percentiles meaningful
+#define STATS_DECAY_THRESHOLD (1u << 31)
+
+/*
+ * Upper bound (inclusive) of every bucket in microseconds. Fine-grained
+ * where healthy edges land, coarse for the tail.
+ */
+static const uint32_t bucket_us[STATS_NUM_BUCKETS] = {
+  0, 1, 2, 3, 4, 5, 6, 8, 10, 12, 15, 20,
+  25, 30, 40, 50, 75, 100, 150, 200, 500, 1000, 5000, UINT32_MAX
+};
+
+/*
+ * Frame level statistics, one block per PWM shard so every block keeps a
+ * single writer. Summaries add the blocks up.
+ */
+typedef struct {
+  StatsHistogram        frame;
+  atomic_uint_least32_t frames;
+  atomic_uint_least32_t overruns;
+  atomic_uint_least32_t wakeups;
+  atomic_uint_least32_t late_wakeups;
+  atomic_bool           reset_requested;
+  // Never reset nor decayed, for scrapers computing rates
+  atomic_uint_least64_t total_frames;
+  atomic_uint_least64_t total_missed;
+  atomic_uint_least64_t total_edges[STATS_NUM_BUCKETS];
+  atomic_uint_least64_t total_late_us;
+  atomic_uint_least64_t total_overruns[STATS_NUM_CAUSES];
+  /*
+   * Overrun history, a ring guarded by a seqlock like the PWM channel
+   * table: the sequence is odd while an entry is written.
+   */
+  atomic_uint           overrun_seq;
+  uint64_t              overrun_count;
+  StatsOverrun          overrun_log[STATS_OVERRUN_HISTORY];
+} StatsShard;
+
+static struct {
+  StatsShard     shards[PWM_MAX_SHARDS];
+  // Each channel is only ever written by the shard driving it
+  StatsHistogram channels[MAX_SERVO_CHANNELS];
+} stats;
+
+// Block of the calling PWM thread, threads that never pick one use shard 0
+static _Thread_local StatsShard *current = &stats.shards[0];
+
+static const char *const cause_names[STATS_NUM_CAUSES] = {
+  [STATS_CAUSE_WAKEUP] = "wakeup",
+  [STATS_CAUSE_EDGES] = "edges",
+  [STATS_CAUSE_PROCESSING] = "processing"
+};
+
+/*
+ * Single writer, so a relaxed load and store is enough and stays lock-free
+ * even where read-modify-write atomics are not.
+ */
+static inline void counter_add(atomic_uint_least32_t *counter, uint32_t value) {
+  uint32_t current = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+static inline uint32_t counter_get(atomic_uint_least32_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline void total_add(atomic_uint_least64_t *total, uint64_t value) {
+  uint64_t current = atomic_load_explicit(total, memory_order_relaxed);
+  atomic_store_explicit(total, current + value, memory_order_relaxed);
+}
+
+static inline uint64_t total_get(atomic_uint_least64_t *total) {
+  return atomic_load_explicit(total, memory_order_relaxed);
+}
+
+static void histogram_decay(StatsHistogram *hist) {
+  uint32_t count = 0;
+
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    uint32_t value = counter_get(&hist->buckets[i]) / 2;
+    atomic_store_explicit(&hist->buckets[i], value, memory_order_relaxed);
+    count += value;
+  }
+
+  atomic_store_explicit(&hist->count, count, memory_order_relaxed);
+}
+
+/**
+ * @return Index of the bucket the value went into
+ */
+static int histogram_record(StatsHistogram *hist, uint32_t late_us) {
+  // Binary search for the first bucket that covers the value
+  int lo = 0;
+  int hi = STATS_NUM_BUCKETS - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (late_us <= bucket_us[mid]) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  if (counter_get(&hist->buckets[lo]) >= STATS_DECAY_THRESHOLD) {
+    histogram_decay(hist);
+  }
+
+  counter_add(&hist->buckets[lo], 1);
+  counter_add(&hist->count, 1);
+
+  if (late_us > counter_get(&hist->max_us)) {
+    atomic_store_explicit(&hist->max_us, late_us, memory_order_relaxed);
+  }
+
+  return lo;
+}
+
+static void histogram_clear(StatsHistogram *hist) {
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    atomic_store_explicit(&hist->buckets[i], 0, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&hist->count, 0, memory_order_relaxed);
+  atomic_store_explicit(&hist->max_us, 0, memory_order_relaxed);
+}
+
+// Plain copy of one or more histograms added up
+typedef struct {
+  uint32_t buckets[STATS_NUM_BUCKETS];
+  uint32_t count;
+  uint32_t max_us;
+} HistogramSnapshot;
+
+static void histogram_add(StatsHistogram *hist, HistogramSnapshot *snap) {
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    snap->buckets[i] += counter_get(&hist->buckets[i]);
+  }
+
+  snap->count += counter_get(&hist->count);
+
+  uint32_t max_us = counter_get(&hist->max_us);
+  if (max_us > snap->max_us) {
+    snap->max_us = max_us;
+  }
+}
+
+/**
+ * Percentile from the histogram, reported as the matching bucket's bound
+ */
+static uint32_t histogram_percentile(const HistogramSnapshot *snap, uint32_t percent) {
+  if (snap->count == 0) {
+    return 0;
+  }
+
+  uint64_t target = ((uint64_t) snap->count * percent + 99) / 100;
+  uint64_t seen = 0;
+
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    seen += snap->buckets[i];
+    if (seen >= target) {
+      return bucket_us[i] < snap->max_us ? bucket_us[i] : snap->max_us;
+    }
+  }
+
+  return snap->max_us;
+}
+
+static void histogram_summary(const HistogramSnapshot *snap, StatsSummary *out) {
+  out->count = snap->count;
+  out->p50_us = histogram_percentile(snap, 50);
+  out->p99_us = histogram_percentile(snap, 99);
+  out->max_us = snap->max_us;
+}
+
+/**
+ * Record statistics of the calling thread into a shard's block from now on
+ */
+void stats_set_shard(uint8_t shard) {
+  if (shard < PWM_MAX_SHARDS) {
+    current = &stats.shards[shard];
+  }
+}
+
+/**
+ * Record the lateness of an edge on a channel
+ */
+void stats_record_edge(uint8_t channel, uint32_t late_us) {
+  if (channel >= MAX_SERVO_CHANNELS) {
+    return;
+  }
+
+  int bucket = histogram_record(&stats.channels[channel], late_us);
+  total_add(&current->total_edges[bucket], 1);
+  total_add(&current->total_late_us, late_us);
+}
+
+/**
+ * Record a finished frame, its worst edge and the frames missed before it
+ */
+void stats_record_frame(uint32_t worst_late_us, uint32_t missed) {
+  histogram_record(&current->frame, worst_late_us);
+  counter_add(&current->frames, 1);
+  total_add(&current->total_frames, 1);
+
+  if (missed > 0) {
+    counter_add(&current->overruns, missed);
+    total_add(&current->total_missed, missed);
+  }
+}
+
+/**
+ * Record a wakeup from the timer or a sleep, late if it overshot its deadline
+ */
+void stats_record_wakeup(bool late) {
+  counter_add(&current->wakeups, 1);
+
+  if (late) {
+    counter_add(&current->late_wakeups, 1);
+  }
+}
+
+/**
+ * Record a frame that started late or after missed frames
+ */
+void stats_record_overrun(const StatsOverrun *overrun) {
+  StatsShard *shard = current;
+  unsigned seq = atomic_load_explicit(&shard->overrun_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&shard->overrun_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  StatsOverrun *entry = &shard->overrun_log[shard->overrun_count % STATS_OVERRUN_HISTORY];
+  *entry = *overrun;
+  entry->shard = shard - stats.shards;
+  shard->overrun_count++;
+
+  atomic_store_explicit(&shard->overrun_seq, seq + 2, memory_order_release);
+
+  total_add(&shard->total_overruns[overrun->cause], 1);
+}
+
+void stats_apply_reset(uint64_t channels) {
+  StatsShard *shard = current;
+
+  if (!atomic_exchange_explicit(&shard->reset_requested, false, memory_order_acquire)) {
+    return;
+  }
+
+  histogram_clear(&shard->frame);
+  for (; channels; channels &= channels - 1) {
+    histogram_clear(&stats.channels[__builtin_ctzll(channels)]);
+  }
+
+  atomic_store_explicit(&shard->frames, 0, memory_order_relaxed);
+  atomic_store_explicit(&shard->overruns, 0, memory_order_relaxed);
+  atomic_store_explicit(&shard->wakeups, 0, memory_order_relaxed);
+  atomic_store_explicit(&shard->late_wakeups, 0, memory_order_relaxed);
+
+  unsigned seq = atomic_load_explicit(&shard->overrun_seq, memory_order_relaxed);
+  atomic_store_explicit(&shard->overrun_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  shard->overrun_count = 0;
+  atomic_store_explicit(&shard->overrun_seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Ask the PWM threads to clear all statistics at their next frame boundary
+ */
+void stats_request_reset(void) {
+  for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+    atomic_store_explicit(&stats.shards[i].reset_requested, true, memory_order_release);
+  }
+}
+
+void stats_frame_summary(StatsFrameSummary *out) {
+  if (!out) {
+    return;
+  }
+
+  HistogramSnapshot snap;
+  memset(&snap, 0, sizeof(snap));
+  memset(out, 0, sizeof(*out));
+
+  for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+    StatsShard *shard = &stats.shards[i];
+
+    out->frames += counter_get(&shard->frames);
+    out->overruns += counter_get(&shard->overruns);
+    out->wakeups += counter_get(&shard->wakeups);
+    out->late_wakeups += counter_get(&shard->late_wakeups);
+    histogram_add(&shard->frame, &snap);
+  }
+
+  histogram_summary(&snap, &out->lateness);
+}
+
+bool stats_channel_summary(uint8_t channel, StatsSummary *out) {
+  if (!out || channel >= MAX_SERVO_CHANNELS) {
+    return false;
+  }
+
+  HistogramSnapshot snap;
+  memset(&snap, 0, sizeof(snap));
+  histogram_add(&stats.channels[channel], &snap);
+  histogram_summary(&snap, out);
+
+  return true;
+}
+
+void stats_totals(StatsTotals *out) {
+  if (!out) {
+    return;
+  }
+
+  memset(out, 0, sizeof(*out));
+
+  for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+    StatsShard *shard = &stats.shards[i];
+
+    out->frames += total_get(&shard->total_frames);
+    out->missed += total_get(&shard->total_missed);
+    out->late_us += total_get(&shard->total_late_us);
+
+    for (int j = 0; j < STATS_NUM_BUCKETS; j++) {
+      out->edges[j] += total_get(&shard->total_edges[j]);
+    }
+
+    for (int j = 0; j < STATS_NUM_CAUSES; j++) {
+      out->overruns[j] += total_get(&shard->total_overruns[j]);
+    }
+  }
+}
+
+/**
+ * Copy a shard's overrun history, oldest first
+ *
+ * Retries until it gets a copy the PWM thread did not write into. Overruns
+ * are rare, so this does not spin for long.
+ *
+ * @return Number of entries copied
+ */
+static size_t shard_overruns(StatsShard *shard, StatsOverrun *out, uint64_t *total) {
+  uint64_t count;
+  StatsOverrun entries[STATS_OVERRUN_HISTORY];
+
+  for (;;) {
+    unsigned seq = atomic_load_explicit(&shard->overrun_seq, memory_order_acquire);
+    if (seq & 1) {
+      continue;
+    }
+
+    count = shard->overrun_count;
+    memcpy(entries, shard->overrun_log, sizeof(entries));
+    atomic_thread_fence(memory_order_acquire);
+
+    if (atomic_load_explicit(&shard->overrun_seq, memory_order_relaxed) == seq) {
+      break;
+    }
+  }
+
+  size_t listed = count < STATS_OVERRUN_HISTORY ? count : STATS_OVERRUN_HISTORY;
+  for (size_t i = 0; i < listed; i++) {
+    out[i] = entries[(count - listed + i) % STATS_OVERRUN_HISTORY];
+  }
+
+  *total += count;
+  return listed;
+}
+
+static int compare_overruns(const void *a, const void *b) {
+  const StatsOverrun *x = a;
+  const StatsOverrun *y = b;
+
+  if (x->frame != y->frame) {
+    return x->frame < y->frame ? -1 : 1;
+  }
+
+  return (int) x->shard - (int) y->shard;
+}
+
+/**
+ * Shards share the frame grid, so frame numbers order their histories
+ */
+size_t stats_overruns(StatsOverrun out[STATS_OVERRUN_HISTORY], uint64_t *total) {
+  StatsOverrun merged[PWM_MAX_SHARDS * STATS_OVERRUN_HISTORY];
+  uint64_t sum = 0;
+  size_t count = 0;
+
+  for (int i = 0; i < PWM_MAX_SHARDS; i++) {
+    count += shard_overruns(&stats.shards[i], merged + count, &sum);
+  }
+
+  qsort(merged, count, sizeof(StatsOverrun), compare_overruns);
+
+  size_t listed = count < STATS_OVERRUN_HISTORY ? count : STATS_OVERRUN_HISTORY;
+  memcpy(out, merged + count - listed, listed * sizeof(StatsOverrun));
+
+  if (total) {
+    *total = sum;
+  }
+
+  return listed;
+}
+
+const char *stats_cause_name(StatsOverrunCause cause) {
+  return cause < STATS_NUM_CAUSES ? cause_names[cause] : "unknown";
+}
+
+uint32_t stats_bucket_us(int bucket) {
+  return bucket_us[bucket];
+}
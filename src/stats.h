@@ -0,0 +1,94 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "servo.h"
+
+#define STATS_NUM_BUCKETS 24
+// Most recent overruns kept for GET OVERRUNS
+#define STATS_OVERRUN_HISTORY 32
+
+/*
+ * Fixed-bucket lateness histogram. Written by the PWM thread only, read by
+ * anyone; all fields are relaxed atomics so neither side ever takes a lock.
+ */
+typedef struct {
+  atomic_uint_least32_t buckets[STATS_NUM_BUCKETS];
+  atomic_uint_least32_t count;
+  atomic_uint_least32_t max_us;
+} StatsHistogram;
+
+typedef struct {
+  uint32_t count;
+  uint32_t p50_us;
+  uint32_t p99_us;
+  uint32_t max_us;
+} StatsSummary;
+
+typedef struct {
+  uint32_t     frames;
+  uint32_t     overruns;
+  uint32_t     wakeups;
+  uint32_t     late_wakeups;
+  StatsSummary lateness;  // Worst edge of each frame
+} StatsFrameSummary;
+
+// What made a frame start late, judged from the frame before it
+typedef enum {
+  STATS_CAUSE_WAKEUP,      // The previous frame finished in time, the wakeup overshot
+  STATS_CAUSE_EDGES,       // Edges of the previous frame ran past the next start
+  STATS_CAUSE_PROCESSING,  // Picking up commands and rebuilding the schedule did
+  STATS_NUM_CAUSES
+} StatsOverrunCause;
+
+typedef struct {
+  uint64_t          frame;        // Number of the late frame
+  uint8_t           shard;        // PWM shard it ran on
+  uint32_t          late_us;      // Wakeup past the first start that was missed
+  uint32_t          duration_us;  // Previous frame, start to end of processing
+  uint32_t          missed;       // Frames skipped entirely
+  StatsOverrunCause cause;
+} StatsOverrun;
+
+// Running totals since startup, unaffected by resets
+typedef struct {
+  uint64_t frames;
+  uint64_t missed;
+  uint64_t overruns[STATS_NUM_CAUSES];
+  uint64_t edges[STATS_NUM_BUCKETS];  // Edges per lateness bucket
+  uint64_t late_us;                   // Lateness of all edges summed up
+} StatsTotals;
+
+// PWM thread side, every thread records into its own shard's block
+void stats_set_shard(uint8_t shard);
+void stats_record_edge(uint8_t channel, uint32_t late_us);
+void stats_record_frame(uint32_t worst_late_us, uint32_t missed);
+void stats_record_wakeup(bool late);
+void stats_record_overrun(const StatsOverrun *overrun);
+// Clears the shard's block and its channels if a reset was requested, call
+// at a frame boundary
+void stats_apply_reset(uint64_t channels);
+
+// Reader side
+void stats_request_reset(void);
+void stats_frame_summary(StatsFrameSummary *out);
+bool stats_channel_summary(uint8_t channel, StatsSummary *out);
+void stats_totals(StatsTotals *out);
+/**
+ * Copy the most recent overruns, oldest first
+ *
+ * @param total Overruns since startup or the last reset
+ *
+ * @return Number of entries copied, at most STATS_OVERRUN_HISTORY
+ */
+size_t stats_overruns(StatsOverrun out[STATS_OVERRUN_HISTORY], uint64_t *total);
+// Lower case name of a cause, e.g. "wakeup"
+const char *stats_cause_name(StatsOverrunCause cause);
+// Inclusive upper bound of a lateness bucket, UINT32_MAX for the last one
+uint32_t stats_bucket_us(int bucket);
+
+#endif /* STATS_H */
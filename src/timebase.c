@@ -0,0 +1,56 @@
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "timebase.h"
+
+// Virtual time starts at one second so "zero" never looks like a timestamp
+#define VIRTUAL_EPOCH_NS NS_PER_SEC
+
+static bool virtual_mode = false;
+static atomic_uint_least64_t virtual_now;
+
+void timebase_set_virtual(void) {
+  virtual_mode = true;
+  atomic_store(&virtual_now, VIRTUAL_EPOCH_NS);
+}
+
+bool timebase_is_virtual(void) {
+  return virtual_mode;
+}
+
+uint64_t timebase_now_ns(void) {
+  if (virtual_mode) {
+    return atomic_load_explicit(&virtual_now, memory_order_relaxed);
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+void timebase_sleep_until(uint64_t deadline_ns) {
+  if (virtual_mode) {
+    if (deadline_ns > atomic_load(&virtual_now)) {
+      atomic_store(&virtual_now, deadline_ns);
+    }
+
+    return;
+  }
+
+  struct timespec ts = {
+    .tv_sec = deadline_ns / NS_PER_SEC,
+    .tv_nsec = deadline_ns % NS_PER_SEC
+  };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+void timebase_advance(uint64_t delta_ns) {
+  if (virtual_mode) {
+    atomic_fetch_add(&virtual_now, delta_ns);
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NS_PER_US 1000ULL
+#define NS_PER_SEC 1000000000ULL
+
+/*
+ * Time source for the PWM engine and everything timestamping its edges.
+ * Normally CLOCK_MONOTONIC; in virtual mode time only moves when someone
+ * sleeps or advances it, so frames run as fast as the CPU allows and every
+ * run is deterministic.
+ */
+
+// Switch to a virtual clock, must be called before anything reads the time
+void timebase_set_virtual(void);
+bool timebase_is_virtual(void);
+
+uint64_t timebase_now_ns(void);
+// Sleep until an absolute deadline, the virtual clock jumps straight to it
+void timebase_sleep_until(uint64_t deadline_ns);
+// Move the virtual clock forward without sleeping, no-op on the real clock
+void timebase_advance(uint64_t delta_ns);
+
+#endif /* TIMEBASE_H */
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "timebase.h"
+#include "watch.h"
+
+// Ticks follow the frames with some jitter, so a subscriber counts as due
+// half a frame early rather than slipping to the next frame
+#define WATCH_SLACK_NS (PWM_FRAME_US * NS_PER_US / 2)
+
+void watch_add(Watch *watch, uint64_t channels, uint16_t rate_hz) {
+  if (rate_hz > 0) {
+    watch->interval_ns = NS_PER_SEC / rate_hz;
+  } else if (watch->interval_ns == 0) {
+    watch->interval_ns = NS_PER_SEC / WATCH_DEFAULT_RATE_HZ;
+  }
+
+  watch->fresh |= channels & ~watch->channels;
+  watch->channels |= channels;
+}
+
+void watch_remove(Watch *watch, uint64_t channels) {
+  watch->channels &= ~channels;
+  watch->fresh &= ~channels;
+}
+
+size_t watch_collect(
+  Watch *watch, const WatchState *states, uint64_t now_ns,
+  char *buffer, size_t buffer_size
+) {
+  size_t length = 0;
+
+  if (now_ns + WATCH_SLACK_NS < watch->next_due_ns) {
+    return 0;
+  }
+
+  for (uint64_t mask = watch->channels; mask; mask &= mask - 1) {
+    int channel = __builtin_ctzll(mask);
+    const WatchState *state = &states[channel];
+    WatchState *sent = &watch->sent[channel];
+    bool fresh = watch->fresh & (1ULL << channel);
+    bool pulse = fresh || state->pulse_us != sent->pulse_us;
+    bool range = fresh || state->min_us != sent->min_us || state->max_us != sent->max_us;
+    bool enabled = fresh || state->enabled != sent->enabled;
+
+    if (!pulse && !range && !enabled) {
+      continue;
+    }
+
+    char line[WATCH_EVENT_LENGTH];
+    int len = snprintf(line, sizeof(line), "EVENT %d", channel);
+
+    if (pulse) {
+      len += snprintf(line + len, sizeof(line) - len, " PULSE %d", state->pulse_us);
+    }
+
+    if (range) {
+      len += snprintf(
+        line + len, sizeof(line) - len,
+        " RANGE %d %d", state->min_us, state->max_us
+      );
+    }
+
+    if (enabled) {
+      len += snprintf(line + len, sizeof(line) - len, " ENABLE %d", state->enabled ? 1 : 0);
+    }
+
+    if (length + len + 1 > buffer_size) {
+      break;
+    }
+
+    memcpy(buffer + length, line, len);
+    buffer[length + len] = '\n';
+    length += len + 1;
+
+    *sent = *state;
+    watch->fresh &= ~(1ULL << channel);
+  }
+
+  if (length > 0) {
+    watch->next_due_ns = now_ns + watch->interval_ns;
+  }
+
+  return length;
+}
@@ -0,0 +1,65 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "servo.h"
+
+// Notification rate of a subscriber, coalesced to at most one per frame
+#define WATCH_DEFAULT_RATE_HZ 10
+#define WATCH_MAX_RATE_HZ PWM_FREQUENCY_HZ
+
+// Longest notification line, and room for one about every channel
+#define WATCH_EVENT_LENGTH 64
+#define WATCH_OUTPUT_SIZE (MAX_SERVO_CHANNELS * WATCH_EVENT_LENGTH)
+
+// What subscribers get told about a channel
+typedef struct {
+    int16_t pulse_us;
+    int16_t min_us;
+    int16_t max_us;
+    bool    enabled;
+} WatchState;
+
+/*
+ * Subscription of one connection. Changes are found by comparing the
+ * current state with what was last sent, so however a channel changed
+ * (command, move, keyframes, shared memory) and however often it changed
+ * in between, the subscriber gets one line with the latest values.
+ */
+typedef struct {
+    uint64_t   channels;     // Watched channels
+    uint64_t   fresh;        // Watched channels whose full state is due
+    uint64_t   interval_ns;
+    uint64_t   next_due_ns;
+    WatchState sent[MAX_SERVO_CHANNELS];
+} Watch;
+
+/**
+ * Watch more channels, their full state goes out with the next update
+ *
+ * @param rate_hz Notification rate, 0 keeps the current one
+ */
+void watch_add(Watch *watch, uint64_t channels, uint16_t rate_hz);
+void watch_remove(Watch *watch, uint64_t channels);
+
+/**
+ * Format notifications for every watched channel that changed since the
+ * last ones, if the subscriber is due
+ *
+ * Each line is EVENT <channel> followed by the fields that changed:
+ * PULSE <us>, RANGE <min> <max> and ENABLE <0|1>.
+ *
+ * @param states Current state of every channel
+ * @param buffer At least WATCH_OUTPUT_SIZE bytes
+ *
+ * @return Number of bytes written
+ */
+size_t watch_collect(
+  Watch *watch, const WatchState *states, uint64_t now_ns,
+  char *buffer, size_t buffer_size
+);
+
+#endif /* WATCH_H */
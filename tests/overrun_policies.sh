@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Replays frames that wake up slightly late and a long stall under every
+# --overrun policy with spinning off, and checks that pulses keep coming out
+# with their commanded widths.
+#
+# Usage: tests/overrun_policies.sh [path/to/piservod]
+
+DAEMON=${1:-./piservod}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Every frame before the stall starts 40us late, well within the tolerance
+{
+  printf 'SETUP 0 GPIO 5\nENABLE 0\nSET 0 PULSE 1500\n.frames 5\n'
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    printf '.stall 18540\n.frames 1\n'
+  done
+  printf '.stall 45000\n.frames 10\nGET OVERRUNS\n'
+} > "$WORK/script.txt"
+
+failed=0
+
+for policy in catchup realign skip; do
+  output=$("$DAEMON" --no-spin --overrun "$policy" --gpio "sim:$WORK/out.vcd" --replay "$WORK/script.txt" 2>&1)
+  pulses=$(printf '%s\n' "$output" | sed -n 's/.*channel 0 gpio 5: .*pulses \([0-9]*\),.*/\1/p')
+  overruns=$(printf '%s\n' "$output" | sed -n 's/^OVERRUNS \([0-9]*\) .*/\1/p')
+
+  # 25 frames, the first runs before ENABLE and the stall costs at most one
+  if [ -z "$pulses" ] || [ "$pulses" -lt 23 ] || [ "$overruns" != 1 ]; then
+    echo "FAIL $policy: pulses ${pulses:-none}, overruns ${overruns:-none}"
+    failed=1
+  else
+    echo "ok   $policy: pulses $pulses, overruns $overruns"
+  fi
+done
+
+# A 333 Hz channel carries falls into the next frame, catchup must not
+# stretch or cut them when it shifts the late frame
+printf 'SETUP 0 GPIO 18\nSET 0 RATE 333\nENABLE 0\nSET 0 PULSE 1800\n.frames 5\n.stall 45000\n.frames 20\n' > "$WORK/carry.txt"
+output=$("$DAEMON" --no-spin --overrun catchup --gpio "sim:$WORK/out.vcd" --replay "$WORK/carry.txt" 2>&1)
+widths=$(printf '%s\n' "$output" | sed -n 's/.*channel 0 gpio 18: .*min \([0-9.]*\), max \([0-9.]*\),.*/\1 \2/p')
+
+if [ "$widths" != "1800.0 1800.0" ]; then
+  echo "FAIL catchup carry: min/max ${widths:-none}"
+  failed=1
+else
+  echo "ok   catchup carry: min/max $widths"
+fi
+
+# A frame dropped by realign or skip must not end pulses it never started
+printf 'SETUP 0 GPIO 18\nSET 0 RATE 333\nENABLE 0\nSET 0 PULSE 1800\n.frames 5\n.stall 45000\n.frames 5\nGET 0 STATS\n' > "$WORK/dropped.txt"
+for policy in realign skip; do
+  output=$("$DAEMON" --no-spin --overrun "$policy" --gpio "sim:$WORK/out.vcd" --replay "$WORK/dropped.txt" 2>&1)
+  edges=$(printf '%s\n' "$output" | sed -n 's/^STATS EDGES \([0-9]*\) .*/\1/p')
+  pulses=$(printf '%s\n' "$output" | sed -n 's/.*channel 0 gpio 18: .*pulses \([0-9]*\),.*/\1/p')
+
+  if [ -z "$edges" ] || [ -z "$pulses" ] || [ "$edges" -ne $((pulses * 2)) ]; then
+    echo "FAIL $policy carry: edges ${edges:-none}, pulses ${pulses:-none}"
+    failed=1
+  else
+    echo "ok   $policy carry: edges $edges, pulses $pulses"
+  fi
+done
+
+exit $failed